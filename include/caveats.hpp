@@ -0,0 +1,106 @@
+#ifndef _CAVEATS_
+#define _CAVEATS_
+
+#include <string>
+#include <vector>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/**
+ * Types of first party caveat understood by the server
+ *
+ * Each type has an entry in the caveat registry (caveats.cpp) which
+ * parses the caveat once, folds repeated caveats of the same type
+ * together, and evaluates the result against a request.
+ * */
+typedef enum {
+    CAVEAT_FUNCTION,        /* "function = N":  N is a bitmask of function codes */
+    CAVEAT_ADDRESS,         /* "address = N":  N is (min << 16) | max */
+    CAVEAT_TYPE_COUNT
+} caveat_type_t;
+
+/**
+ * Binary encoding of a caveat, as created by the client
+ *
+ * A one-byte tag, then the caveat's values as LEB128 varints of
+ * value + 1, so an encoded caveat never contains a NUL byte:
+ *
+ *   CAVEAT_TAG_FUNCTION | varint(mask + 1)
+ *   CAVEAT_TAG_ADDRESS  | varint(min + 1) | varint(max + 1)
+ *
+ * e.g., "function = 2048" (15 bytes) is 3 bytes.  The server also accepts
+ * the textual form above, from older clients.
+ * */
+#define CAVEAT_TAG_FUNCTION 0x01
+#define CAVEAT_TAG_ADDRESS  0x02
+
+/* Outcome of checking a request against a set of compiled caveats */
+typedef enum {
+    CAVEAT_PASS,
+    CAVEAT_FAIL_FUNCTION,   /* function missing from, or excluded by, the caveats */
+    CAVEAT_FAIL_ADDRESS     /* addresses missing from, or outside, the caveats */
+} caveat_result_t;
+
+/* A single caveat, parsed into a typed predicate */
+typedef struct {
+    uint32_t function_mask;     /* CAVEAT_FUNCTION */
+    uint16_t addr_min;          /* CAVEAT_ADDRESS */
+    uint16_t addr_max;
+} caveat_t;
+
+/**
+ * All first party caveats of a Macaroon, compiled
+ *
+ * Caveats of the same type are folded into one predicate (function masks
+ * are intersected, address ranges are intersected), so checking a request
+ * costs the same however many caveats the Macaroon carries.
+ * */
+typedef struct {
+    uint32_t present;                           /* bit per caveat_type_t seen */
+    caveat_t predicates[CAVEAT_TYPE_COUNT];     /* indexed by caveat_type_t */
+} compiled_caveats_t;
+
+/* The request being authorised, as seen by the caveat predicates */
+typedef struct {
+    int function;
+    uint16_t addr_min;
+    uint16_t addr_max;
+} caveat_request_t;
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+std::string create_function_caveat(std::string function_code);
+std::string create_function_caveat(int function_code);
+std::string create_function_caveat(std::vector<int> function_codes);
+std::string create_address_caveat(uint16_t min, uint16_t max);
+
+/******************
+ * COMMON FUNCTIONS
+ *****************/
+
+uint16_t find_max_address(int function, uint16_t addr, int nb);
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+void compiled_caveats_init(compiled_caveats_t *caveats);
+
+/**
+ * Parse a single first party caveat and fold it into caveats.
+ *
+ * Returns false if the caveat is not understood or is malformed; a
+ * Macaroon carrying such a caveat must not be accepted.
+ * */
+bool compiled_caveats_add(compiled_caveats_t *caveats, const char *caveat, size_t length);
+
+/* Check a request against compiled caveats.  Never allocates. */
+caveat_result_t check_caveats(const compiled_caveats_t *caveats,
+                              int function, uint16_t addr, int nb);
+
+#endif /* _CAVEATS_ */
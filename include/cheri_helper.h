@@ -1,7 +1,7 @@
 #ifndef _CHERI_HELPER_H_
 #define _CHERI_HELPER_H_
 
-#include <cheriintrin.h>
+#include "cheri_portable.h"
 // #include "libcheri_type.h"
 
 #define CHERI_PRINT_CAP(cap)                            \
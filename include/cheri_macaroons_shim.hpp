@@ -2,6 +2,7 @@
 #define _CHERI_MACAROONS_SHIM_
 
 #include <iostream>
+#include <vector>
 
 /* for Modbus */
 extern "C" {
@@ -11,14 +12,17 @@ extern "C" {
 /* Macaroons */
 #include "macaroons/macaroons.hpp"
 
-/* CHERI */
-#ifndef __has_feature
-#define __has_feature(x) 0
-#endif
+/* logging */
+#include "shim_log.hpp"
 
-#if !__has_feature(capabilities)
-#error "<cheri_macaroons_shim.h> should only be included when CHERI is supported"
-#endif
+/* compiled Macaroon caveats */
+#include "caveats.hpp"
+
+/* concurrent access to the mapping tables */
+#include "mapping_seqlock.hpp"
+
+/* session MACs */
+#include "hmac_sha256.hpp"
 
 typedef enum {
     NONE,
@@ -27,11 +31,68 @@ typedef enum {
     CHERI_MACAROONS
 } shim_t;
 
+/**
+ * Per-connection state kept by the shims
+ *
+ * Each connection installs and uses its own Macaroon, so clients cannot
+ * overwrite each other's token.  A session is only ever used by one
+ * thread at a time (see server_loop.cpp).
+ *
+ * A connection may also open a MAC session on its Macaroon (see
+ * tcp_frame.hpp), after which requests carry a MAC instead of a token,
+ * or exchange its Macaroon for a handle (token_handle.hpp).
+ * */
+typedef struct {
+    uint64_t id;                        /* unique to the connection; owns its token handles */
+    bool token_valid;                   /* a verified Macaroon is installed */
+    compiled_caveats_t token_caveats;   /* its caveats, compiled once */
+    uint8_t token_signature[HMAC_SHA256_LENGTH];    /* its signature */
+    bool token_signed;                  /* token_signature matches the caveats (not a handle's) */
+    std::vector<uint8_t> token_chunks;  /* a token being written in chunks */
+    bool mac_session;                   /* a MAC session is open on the Macaroon */
+    hmac_sha256_ctx_t session_mac;      /* keyed with the session key */
+    uint32_t session_sequence;          /* of the last request accepted */
+    mapping_seqlock_t *seqlock;         /* optional, shared by every session on a mapping */
+} shim_session_t;
+
+/* Initialise a session with no Macaroon installed */
+void shim_session_init(shim_session_t *session, mapping_seqlock_t *seqlock);
+
+/**
+ * Reasons a shim refuses a request
+ *
+ * A refused request is answered with a Modbus exception and the
+ * connection stays open; the number of requests refused for each reason
+ * is counted (see get_shim_reject_count()).
+ * */
 typedef enum {
-    INIT,
-    CHERI_X,
-    MACAROONS_X
-} shim_s;
+    SHIM_REJECT_MALFORMED,      /* authenticated request that cannot be unwrapped */
+    SHIM_REJECT_TOKEN,          /* no verified Macaroon installed */
+    SHIM_REJECT_FUNCTION,       /* function not allowed by the caveats */
+    SHIM_REJECT_ADDRESS,        /* addresses outside the caveats */
+    SHIM_REJECT_CAPABILITY,     /* capability check failed */
+    SHIM_REJECT_SESSION,        /* no MAC session, bad MAC or replayed sequence */
+    SHIM_REJECT_HANDLE,         /* token handle unknown or evicted */
+    SHIM_REJECT_COUNT
+} shim_reject_t;
+
+/**
+ * A request as decomposed by libmodbus:modbus_decompose_request()
+ *
+ * It is decoded once, on the stack, by the shim pipeline (see
+ * shim_pipeline.hpp) and then handed to every shim stage, so processing
+ * a request needs no heap allocation.
+ * */
+typedef struct {
+    int offset;
+    int slave_id;
+    int function;
+    uint16_t addr;
+    int nb;
+    uint16_t addr_wr;   /* only for write_and_read_registers */
+    int nb_wr;          /* only for write_and_read_registers */
+    shim_session_t *session;    /* the connection the request arrived on */
+} shim_request_t;
 
 
 /*********
@@ -46,14 +107,17 @@ const std::string display_marker(80, '*');
  * HELPER FUNCTIONS
  *****************/
 
-void print_shim_info(std::string file, std::string function);
 void print_modbus_function_name(int function);
-std::string get_modbus_function_name(int function);
+const char *get_modbus_function_name(int function);
 void print_mb_mapping(modbus_mapping_t* mb_mapping);
-void print_modbus_decompose_request(modbus_t *ctx, const uint8_t *req,
-                                    int *offset, int *slave_id, int *function,
-                                    uint16_t *addr, int *nb,
-                                    uint16_t *addr_wr, int *nb_wr);
+void print_modbus_decompose_request(const shim_request_t *request);
+const char *get_shim_reject_name(shim_reject_t reason);
+
+/* Requests refused for reason since the server started */
+uint64_t get_shim_reject_count(shim_reject_t reason);
+
+/* Log the reject counters at SHIM_LOG_LEVEL_INFO */
+void log_shim_reject_counts(void);
 
 /******************
  * CLIENT FUNCTIONS
@@ -128,6 +192,16 @@ modbus_mapping_t* modbus_mapping_new_start_address(
 /* Receive the request from a modbus master */
 int modbus_receive(modbus_t *ctx, uint8_t *req, shim_t shim_type);
 
+/**
+ * Refuse req for reason: count it, and build the exception response for
+ * function into rsp, to be sent as any other response.
+ *
+ * Returns the length of the response.
+ * */
+int shim_reply_exception(modbus_t *ctx, const uint8_t *req,
+                         uint8_t *rsp, int *rsp_length,
+                         int function, shim_reject_t reason);
+
 /**
  * Analyses the request and constructs a response.
  *
@@ -137,6 +211,22 @@ int modbus_receive(modbus_t *ctx, uint8_t *req, shim_t shim_type);
 int modbus_process_request(modbus_t *ctx, uint8_t *req,
                            int req_length, uint8_t *rsp, int *rsp_length,
                            modbus_mapping_t *mb_mapping,
-                           shim_t shim_type, shim_s shim_state);
+                           shim_t shim_type);
+
+/* As above, for a request that arrived on the connection owning session */
+int modbus_process_request(modbus_t *ctx, uint8_t *req,
+                           int req_length, uint8_t *rsp, int *rsp_length,
+                           modbus_mapping_t *mb_mapping,
+                           shim_session_t *session,
+                           shim_t shim_type);
+
+/**
+ * The execution stage of the shim pipeline: libmodbus processes the
+ * request, through session->seqlock if set.
+ * */
+int shim_execute_request(modbus_t *ctx, uint8_t *req,
+                         int req_length, uint8_t *rsp, int *rsp_length,
+                         modbus_mapping_t *mb_mapping,
+                         shim_session_t *session);
 
 #endif /* _CHERI_MACAROONS_SHIM_ */
\ No newline at end of file
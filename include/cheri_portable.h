@@ -0,0 +1,119 @@
+#ifndef _CHERI_PORTABLE_H_
+#define _CHERI_PORTABLE_H_
+
+/**
+ * Capability backend for the CHERI shim
+ *
+ * On a CHERI target, the shim's cheri_perms_and()/cheri_bounds_set() calls
+ * are the real intrinsics and the hardware checks every access libmodbus
+ * makes through the restricted views.
+ *
+ * Elsewhere (e.g., x86-64 build and test hosts) the intrinsics return the
+ * pointer unchanged, and the bounds and permissions of each view are
+ * carried in a software capability (cheri_soft_cap_t) instead.  libmodbus
+ * still dereferences plain pointers, so the shim checks every table access
+ * a request implies against the view's software capabilities, with
+ * cheri_soft_cap_check(), before libmodbus makes it; a failed check stands
+ * in for a capability fault.  A stray access inside libmodbus itself is
+ * only caught on CHERI hardware.
+ *
+ * Defining CHERI_SOFT_TRUST (the CMake option of the same name) turns the
+ * software checks into constants, so they compile away entirely.  Use it to
+ * measure the cost of the checks themselves.
+ * */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+
+#if __has_feature(capabilities)
+
+#include <cheriintrin.h>
+#define CHERI_HARDWARE 1
+
+#else /* !__has_feature(capabilities) */
+
+#define CHERI_HARDWARE 0
+
+#define CHERI_PERM_GLOBAL           (1 << 0)
+#define CHERI_PERM_EXECUTE          (1 << 1)
+#define CHERI_PERM_LOAD             (1 << 2)
+#define CHERI_PERM_STORE            (1 << 3)
+#define CHERI_PERM_LOAD_CAP         (1 << 4)
+#define CHERI_PERM_STORE_CAP        (1 << 5)
+#define CHERI_PERM_STORE_LOCAL_CAP  (1 << 6)
+#define CHERI_PERM_SEAL             (1 << 7)
+#define CHERI_PERM_CCALL            (1 << 8)
+#define CHERI_PERM_UNSEAL           (1 << 9)
+#define CHERI_PERM_SYSTEM_REGS      (1 << 10)
+
+/* A plain pointer behaves as an unsealed capability to the whole address space */
+#define cheri_perms_and(cap, perms)     ((void)(perms), (cap))
+#define cheri_bounds_set(cap, length)   ((void)(length), (cap))
+#define cheri_tag_get(cap)              ((cap) != NULL)
+#define cheri_is_sealed(cap)            0
+#define cheri_perms_get(cap)            ((size_t)0x7FF)
+#define cheri_base_get(cap)             ((uintmax_t)0)
+#define cheri_length_get(cap)           SIZE_MAX
+#define cheri_offset_get(cap)           ((uintmax_t)(uintptr_t)(cap))
+#define cheri_type_get(cap)             (-1L)
+
+#endif /* __has_feature(capabilities) */
+
+/* Software checks are only made without hardware, and when not trusted */
+#if !CHERI_HARDWARE && !defined(CHERI_SOFT_TRUST)
+#define CHERI_SOFT_CHECKS 1
+#else
+#define CHERI_SOFT_CHECKS 0
+#endif
+
+/* Bounds and permissions of a pointer, as a capability would carry them */
+typedef struct {
+    uintptr_t base;
+    size_t length;
+    size_t perms;
+} cheri_soft_cap_t;
+
+static inline cheri_soft_cap_t
+cheri_soft_cap_new(const void *base, size_t length, size_t perms)
+{
+    cheri_soft_cap_t cap;
+
+    cap.base = (uintptr_t)base;
+    cap.length = length;
+    cap.perms = perms;
+
+    return cap;
+}
+
+/**
+ * Check an access of length bytes at addr requiring perms: every one of
+ * perms must be granted, and the whole access must lie within the bounds.
+ *
+ * Always true on CHERI hardware (the hardware checks the access itself)
+ * and with CHERI_SOFT_TRUST.
+ * */
+static inline bool
+cheri_soft_cap_check(const cheri_soft_cap_t *cap, const void *addr, size_t length, size_t perms)
+{
+#if CHERI_SOFT_CHECKS
+    uintptr_t a = (uintptr_t)addr;
+
+    return (cap->perms & perms) == perms &&
+           a >= cap->base &&
+           length <= cap->length &&
+           a - cap->base <= cap->length - length;
+#else
+    (void)cap;
+    (void)addr;
+    (void)length;
+    (void)perms;
+    return true;
+#endif
+}
+
+#endif /* _CHERI_PORTABLE_H_ */
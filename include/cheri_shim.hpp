@@ -3,15 +3,7 @@
 
 #include <iostream>
 
-/* For CHERI */
-#ifndef __has_feature
-#define __has_feature(x) 0
-#endif
-
-#if !__has_feature(capabilities)
-#error "<cheri_shim.h> should only be included when CHERI is supported"
-#endif
-
+/* For CHERI (hardware, or the software backend elsewhere) */
 #include "cheri_helper.h"
 
 /* for modbus */
@@ -22,6 +14,54 @@ extern "C" {
 /* shim support */
 #include "cheri_macaroons_shim.hpp"
 
+/**
+ * Views of a mapping, one per class of function code
+ *
+ * Each view is a copy of the mapping whose table capabilities carry only
+ * the permissions its function codes need (e.g., a read-only tab_bits for
+ * MODBUS_FC_READ_COILS, and no access to the other tables).
+ * */
+typedef enum {
+    CHERI_VIEW_READ_COILS,
+    CHERI_VIEW_READ_DISCRETE_INPUTS,
+    CHERI_VIEW_READ_HOLDING_REGISTERS,
+    CHERI_VIEW_READ_INPUT_REGISTERS,
+    CHERI_VIEW_WRITE_COILS,
+    CHERI_VIEW_WRITE_REGISTERS,
+    CHERI_VIEW_READ_WRITE_REGISTERS,
+    CHERI_VIEW_REPORT_SLAVE_ID,
+    CHERI_VIEW_WRITE_STRING,
+    CHERI_VIEW_READ_STRING,
+    CHERI_VIEW_NONE,            /* any other function code */
+    CHERI_VIEW_COUNT
+} cheri_view_t;
+
+/* Tables of a mapping, indexing the software capabilities of a view */
+typedef enum {
+    CHERI_TABLE_BITS,
+    CHERI_TABLE_INPUT_BITS,
+    CHERI_TABLE_INPUT_REGISTERS,
+    CHERI_TABLE_REGISTERS,
+    CHERI_TABLE_STRING,
+    CHERI_TABLE_COUNT
+} cheri_table_t;
+
+/**
+ * A mapping created by modbus_mapping_new_start_address_cheri()
+ *
+ * mapping must be the first member: callers only ever see a
+ * modbus_mapping_t *, which modbus_restrict_request_cheri() converts back.
+ * The views are derived once, when the mapping is created, and are
+ * read-only afterwards.  caps holds the same bounds and permissions for
+ * the software backend (see cheri_portable.h).
+ * */
+typedef struct {
+    modbus_mapping_t mapping;
+    modbus_mapping_t *views[CHERI_VIEW_COUNT];          /* restricted capabilities to view_storage */
+    modbus_mapping_t view_storage[CHERI_VIEW_COUNT];
+    cheri_soft_cap_t caps[CHERI_VIEW_COUNT][CHERI_TABLE_COUNT];
+} cheri_mapping_t;
+
 /**
  *  Allocates 5 arrays to store bits, input bits, registers, inputs
  * registers, and a string. The pointers are stored in modbus_mapping structure.
@@ -36,9 +76,9 @@ modbus_mapping_t* modbus_mapping_new_start_address_cheri(
     unsigned int start_registers, unsigned int nb_registers,
     unsigned int start_input_registers, unsigned int nb_input_registers);
 
-int modbus_process_request_cheri(modbus_t *ctx, uint8_t *req,
-                                int req_length, uint8_t *rsp, int *rsp_length,
-                                modbus_mapping_t *mb_mapping,
-                                shim_t shim_type, shim_s shim_state);
+modbus_mapping_t *modbus_restrict_request_cheri(modbus_t *ctx, const uint8_t *req,
+                                                uint8_t *rsp, int *rsp_length,
+                                                modbus_mapping_t *mb_mapping,
+                                                const shim_request_t *request, int *rc);
 
 #endif /* _CHERI_SHIM_ */
@@ -0,0 +1,99 @@
+#ifndef _HMAC_SHA256_
+#define _HMAC_SHA256_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * SHA-256 and HMAC-SHA256, as used by libmacaroons to chain Macaroon
+ * signatures
+ *
+ * The contexts are fixed-size and live on the caller's stack; nothing
+ * here allocates.
+ * */
+#define HMAC_SHA256_LENGTH 32
+#define HMAC_SHA256_BLOCK_LENGTH 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                            /* bytes hashed so far */
+    uint8_t block[HMAC_SHA256_BLOCK_LENGTH];    /* partial block */
+    size_t block_length;
+} sha256_ctx_t;
+
+typedef struct {
+    sha256_ctx_t inner;
+    sha256_ctx_t outer;
+} hmac_sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t length);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[HMAC_SHA256_LENGTH]);
+
+void hmac_sha256_init(hmac_sha256_ctx_t *ctx, const uint8_t *key, size_t key_length);
+void hmac_sha256_update(hmac_sha256_ctx_t *ctx, const uint8_t *data, size_t length);
+void hmac_sha256_final(hmac_sha256_ctx_t *ctx, uint8_t mac[HMAC_SHA256_LENGTH]);
+
+/* One-shot HMAC-SHA256 of data under key */
+void hmac_sha256(const uint8_t *key, size_t key_length,
+                 const uint8_t *data, size_t length,
+                 uint8_t mac[HMAC_SHA256_LENGTH]);
+
+/* Compare two MACs in constant time */
+bool hmac_sha256_equal(const uint8_t a[HMAC_SHA256_LENGTH], const uint8_t b[HMAC_SHA256_LENGTH]);
+
+/* Compare the first length bytes of two MACs (truncated MACs) in constant time */
+bool hmac_sha256_truncated_equal(const uint8_t *a, const uint8_t *b, size_t length);
+
+/**
+ * Batched HMAC-SHA256
+ *
+ * A batch of independent HMACs (e.g., the chain steps of tokens being
+ * verified by different workers) is computed by the selected backend:
+ *
+ * - HMAC_SHA256_SCALAR computes them one after the other.
+ * - HMAC_SHA256_MULTI_BUFFER hashes HMAC_SHA256_LANES messages in
+ *   lockstep, one vector lane each.  It needs GCC or Clang vector
+ *   extensions; on x86-64 GCC builds the AVX2 kernel is picked at load
+ *   time where the CPU has it.
+ *
+ * Both give results identical to hmac_sha256().
+ * */
+#define HMAC_SHA256_LANES 8
+
+typedef enum {
+    HMAC_SHA256_SCALAR,
+    HMAC_SHA256_MULTI_BUFFER
+} hmac_sha256_backend_t;
+
+typedef struct {
+    const uint8_t *key;
+    size_t key_length;
+    const uint8_t *data;
+    size_t length;
+    uint8_t *mac;           /* HMAC_SHA256_LENGTH bytes */
+} hmac_sha256_job_t;
+
+/**
+ * Select the backend for hmac_sha256_batch().  The default is
+ * HMAC_SHA256_MULTI_BUFFER where it is available.
+ *
+ * Returns false if backend is not available in this build.
+ * */
+bool hmac_sha256_set_backend(hmac_sha256_backend_t backend);
+hmac_sha256_backend_t hmac_sha256_get_backend(void);
+
+/* Compute every job of the batch */
+void hmac_sha256_batch(hmac_sha256_job_t *jobs, int nb_jobs);
+
+/**
+ * As hmac_sha256(), but calls made concurrently from several threads are
+ * combined: one caller computes every pending job in a single batch
+ * while the others wait for their result.  A caller alone computes its
+ * own job straight away.
+ * */
+void hmac_sha256_combined(const uint8_t *key, size_t key_length,
+                          const uint8_t *data, size_t length,
+                          uint8_t mac[HMAC_SHA256_LENGTH]);
+
+#endif /* _HMAC_SHA256_ */
@@ -0,0 +1,72 @@
+#ifndef _MACAROON_VIEW_
+#define _MACAROON_VIEW_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+#include "hmac_sha256.hpp"
+
+/**
+ * Allocation-free parsing of serialised Macaroons
+ *
+ * The server's fast path parses a token straight from the bytes it
+ * arrived in, rather than through libmacaroons::Macaroon::deserialize(),
+ * which allocates and reports bad input by throwing.  The token is
+ * base64-decoded into a buffer inside the view and its fields are
+ * pointers into that buffer; nothing is copied or allocated, and every
+ * failure is a return code.
+ *
+ * The libmacaroons V1 format is understood: base64 (standard or
+ * URL-safe, padding optional) of packets
+ *
+ *   4 hex digit packet length | key | ' ' | value | '\n'
+ *
+ * for location, identifier, each caveat (cid) and the signature, in that
+ * order.  A well-formed token this parser does not cover (V2, third
+ * party caveats, too large) is reported as MACAROON_VIEW_UNSUPPORTED, to
+ * be handled by libmacaroons.  A token with more than
+ * MACAROON_VIEW_MAX_CAVEATS caveats is refused outright.
+ * */
+#define MACAROON_VIEW_MAX_LENGTH MODBUS_MAX_STRING_LENGTH   /* decoded bytes */
+#define MACAROON_VIEW_MAX_CAVEATS 16
+
+typedef enum {
+    MACAROON_VIEW_OK,
+    MACAROON_VIEW_INVALID,      /* not a Macaroon: reject it */
+    MACAROON_VIEW_UNSUPPORTED   /* a Macaroon, but not one parsed here */
+} macaroon_view_result_t;
+
+/* Non-owning view of some bytes */
+typedef struct {
+    const char *data;
+    size_t length;
+} byte_view_t;
+
+typedef struct {
+    byte_view_t location;
+    byte_view_t identifier;
+    byte_view_t caveats[MACAROON_VIEW_MAX_CAVEATS];     /* first party only */
+    int nb_caveats;
+    const uint8_t *signature;                           /* HMAC_SHA256_LENGTH bytes */
+    uint8_t decoded[MACAROON_VIEW_MAX_LENGTH];          /* the views point in here */
+} macaroon_view_t;
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+/**
+ * Parse the serialised Macaroon token (token_length bytes, not NUL
+ * terminated) into view.
+ *
+ * Returns MACAROON_VIEW_OK, or why the token was not parsed.
+ * */
+macaroon_view_result_t macaroon_view_parse(macaroon_view_t *view,
+                                           const uint8_t *token, size_t token_length);
+
+#endif /* _MACAROON_VIEW_ */
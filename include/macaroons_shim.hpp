@@ -4,6 +4,12 @@
 #include <iostream>
 #include <random>
 #include <cassert>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <stdio.h>
+#include <string.h>
 
 /* for Modbus */
 extern "C" {
@@ -15,23 +21,69 @@ extern "C" {
 
 /* shim support */
 #include "cheri_macaroons_shim.hpp"
+#include "caveats.hpp"
+#include "tcp_frame.hpp"
+#include "hmac_sha256.hpp"
+#include "macaroon_view.hpp"
+#include "token_filter.hpp"
+#include "token_handle.hpp"
 
 /******************
  * SERVER FUNCTIONS
  *****************/
 
+/**
+ * Initialise the server Macaroon, or rotate its key while serving: tokens
+ * are verified against the previous key or the new one, never a mix.
+ * */
 int initialise_server_macaroon(std::string location, std::string key, std::string id);
 int modbus_receive_macaroons(modbus_t *ctx, uint8_t *req);
-int modbus_process_request_macaroons(modbus_t *ctx, uint8_t *req,
-                                     int req_length, uint8_t *rsp, int *rsp_length,
-                                     modbus_mapping_t *mb_mapping,
-                                     shim_t shim_type, shim_s shim_state);
+int modbus_unwrap_request_macaroons(modbus_t *ctx, uint8_t *req, int req_length,
+                                    shim_session_t *session);
+int modbus_process_session_open_macaroons(modbus_t *ctx, const uint8_t *req,
+                                          uint8_t *rsp, int *rsp_length,
+                                          shim_session_t *session);
+int modbus_unwrap_session_macaroons(modbus_t *ctx, uint8_t *req, int req_length,
+                                    shim_session_t *session, shim_reject_t *reason);
+int modbus_process_install_handle_macaroons(modbus_t *ctx, const uint8_t *req,
+                                            uint8_t *rsp, int *rsp_length,
+                                            shim_session_t *session);
+int modbus_unwrap_handle_macaroons(modbus_t *ctx, uint8_t *req, int req_length,
+                                   shim_session_t *session, shim_reject_t *reason);
+int modbus_process_token_chunk_macaroons(modbus_t *ctx, const uint8_t *req, int req_length,
+                                         uint8_t *rsp, int *rsp_length,
+                                         shim_session_t *session);
+
+/* stages of the shim pipeline (see shim_pipeline.hpp) */
+bool modbus_admit_request_macaroons(modbus_t *ctx, uint8_t *req, int *req_length,
+                                    uint8_t *rsp, int *rsp_length,
+                                    shim_session_t *session, int *rc);
+bool modbus_authorise_request_macaroons(modbus_t *ctx, const uint8_t *req,
+                                        uint8_t *rsp, int *rsp_length,
+                                        modbus_mapping_t *mb_mapping,
+                                        const shim_request_t *request,
+                                        std::unique_lock<std::mutex> *string_lock, int *rc);
+void modbus_complete_request_macaroons(modbus_mapping_t *mb_mapping,
+                                       const shim_request_t *request, int rc);
 
 /******************
  * CLIENT FUNCTIONS
  *****************/
 
 int initialise_client_macaroon(modbus_t *ctx);
+int attenuate_client_macaroon(int function, uint16_t addr, int nb, std::string *token);
+int modbus_send_request_macaroons(modbus_t *ctx, const std::string &token,
+                                  const uint8_t *pdu, int pdu_length);
+
+/* MAC sessions (see tcp_frame.hpp) */
+int modbus_open_session_macaroons(modbus_t *ctx, const std::vector<int> &functions,
+                                  uint16_t addr_min, uint16_t addr_max);
+void modbus_close_session_macaroons(modbus_t *ctx);
+bool modbus_session_is_open_macaroons(modbus_t *ctx);
+int modbus_send_session_request_macaroons(modbus_t *ctx, const uint8_t *pdu, int pdu_length);
+
+/* token handles (see tcp_frame.hpp) */
+void modbus_set_token_handles_macaroons(modbus_t *ctx, bool enable);
 
 /**
  * no function required for read/write token
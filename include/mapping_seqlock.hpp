@@ -0,0 +1,58 @@
+#ifndef _MAPPING_SEQLOCK_
+#define _MAPPING_SEQLOCK_
+
+#include <atomic>
+#include <mutex>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/**
+ * Concurrent access to the tables of a modbus_mapping_t
+ *
+ * Every table (coils, discrete inputs, holding registers, input
+ * registers, string) has a sequence counter, which is odd while the
+ * table is being written, and a writer mutex.
+ *
+ * - Requests that write a table take its writer mutex, so writes to one
+ *   table are serialised while the other tables stay available.
+ * - Requests that only read take no lock: libmodbus builds the response
+ *   from the table, and the response is discarded and rebuilt if the
+ *   table was written meanwhile.  A multi-register value (e.g., a 32-bit
+ *   float) is therefore never returned torn.
+ * */
+typedef enum {
+    MAPPING_TABLE_BITS,
+    MAPPING_TABLE_INPUT_BITS,
+    MAPPING_TABLE_REGISTERS,
+    MAPPING_TABLE_INPUT_REGISTERS,
+    MAPPING_TABLE_STRING,
+    MAPPING_TABLE_COUNT
+} mapping_table_t;
+
+typedef struct {
+    std::atomic<unsigned> sequence;     /* odd while a write is in progress */
+    std::mutex writer;
+} table_seqlock_t;
+
+typedef struct {
+    table_seqlock_t tables[MAPPING_TABLE_COUNT];
+} mapping_seqlock_t;
+
+void mapping_seqlock_init(mapping_seqlock_t *seqlock);
+
+/**
+ * Call libmodbus:modbus_process_request() for req, holding the writer
+ * mutex of every table the function writes, or retrying until the
+ * tables it reads were not written during the call.
+ *
+ * Returns as modbus_process_request().
+ * */
+int mapping_seqlock_process_request(mapping_seqlock_t *seqlock, modbus_t *ctx,
+                                    uint8_t *req, int req_length,
+                                    uint8_t *rsp, int *rsp_length,
+                                    modbus_mapping_t *mb_mapping);
+
+#endif /* _MAPPING_SEQLOCK_ */
@@ -0,0 +1,120 @@
+#ifndef _SCAN_LIST_
+#define _SCAN_LIST_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/* shim support */
+#include "cheri_macaroons_shim.hpp"
+#include "mapping_seqlock.hpp"
+
+/**
+ * Client scan lists
+ *
+ * An HMI polls many scattered points, and one read per point costs a
+ * request (and, in the Macaroons modes, an attenuated token) each.  A
+ * scan list collects the points, then compiles them into the fewest
+ * reads that cover them:
+ *
+ * - points of the same table are merged into one read when at most
+ *   max_gap unrequested addresses separate them, and
+ * - no read exceeds the protocol limits (MODBUS_MAX_READ_REGISTERS
+ *   registers, MODBUS_MAX_READ_BITS bits).
+ *
+ * Each read is authorised by a Macaroon attenuated to its merged range,
+ * which the client token cache keeps from one scan to the next.  The
+ * reads of a scan are pipelined (see shim_async.hpp), and the values are
+ * scattered back to the points they were requested for.
+ *
+ * The addresses in a gap are read too, so max_gap must only bridge
+ * addresses the server maps; otherwise the merged read is refused.
+ * */
+#define SCAN_LIST_DEFAULT_GAP 8
+
+typedef struct {
+    mapping_table_t table;  /* MAPPING_TABLE_STRING is not scanned */
+    uint16_t addr;
+    uint16_t value;         /* a bit reads as 0 or 1 */
+    bool valid;             /* value was read by the last scan */
+} scan_point_t;
+
+/* One read of the compiled plan */
+typedef struct {
+    mapping_table_t table;
+    uint16_t addr;
+    int nb;
+    size_t first;           /* its points, as an index into order */
+    size_t nb_points;
+    size_t buffer;          /* offset of its values in bits or registers */
+} scan_request_t;
+
+typedef struct scan_list_s scan_list_t;
+
+/* Completion context of one read */
+typedef struct {
+    scan_list_t *list;
+    size_t request;
+} scan_completion_t;
+
+struct scan_list_s {
+    int max_gap;
+    std::vector<scan_point_t> points;           /* in the order added */
+    std::vector<size_t> order;                  /* points sorted by table and address */
+    std::vector<scan_request_t> requests;       /* the compiled plan */
+    std::vector<scan_completion_t> completions; /* indexed like requests */
+    std::vector<uint8_t> bits;                  /* values read, bit tables */
+    std::vector<uint16_t> registers;            /* values read, register tables */
+    int nb_failed;                              /* reads failed by the last scan */
+    int error;                                  /* errno of the last failure */
+};
+
+/* Called after each scan with its result; return false to stop scanning */
+typedef bool (*scan_callback_t)(const scan_list_t *list, int rc, void *user);
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+/* Initialise an empty scan list merging across at most max_gap addresses */
+void scan_list_init(scan_list_t *list, int max_gap);
+
+/**
+ * Add the point (table, addr).  The plan must be compiled again before
+ * the next scan.
+ *
+ * Returns the index of the point in list->points, or -1 with errno set
+ * to EINVAL if table cannot be scanned.
+ * */
+int scan_list_add(scan_list_t *list, mapping_table_t table, uint16_t addr);
+
+/**
+ * Compile the points into the fewest reads within the protocol limits.
+ *
+ * Returns the number of reads in the plan.
+ * */
+int scan_list_compile(scan_list_t *list);
+
+/**
+ * Execute the compiled plan once on the connected ctx, with up to
+ * SHIM_ASYNC_DEFAULT_WINDOW reads in flight, and scatter the values to
+ * the points.  The points of a failed read are marked invalid.
+ *
+ * Returns 0, or -1 with errno set if any read failed.
+ * */
+int scan_list_execute(scan_list_t *list, modbus_t *ctx, shim_t shim_type);
+
+/**
+ * Execute the plan every period_ms milliseconds, calling callback after
+ * each scan, until callback returns false.  A scan that overruns the
+ * period is followed immediately by the next.
+ * */
+void scan_list_run(scan_list_t *list, modbus_t *ctx, shim_t shim_type,
+                   int period_ms, scan_callback_t callback, void *user);
+
+#endif /* _SCAN_LIST_ */
@@ -0,0 +1,69 @@
+#ifndef _SERVER_LOOP_
+#define _SERVER_LOOP_
+
+#include <atomic>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/* shim support */
+#include "cheri_macaroons_shim.hpp"
+#include "tcp_frame.hpp"
+
+/**
+ * Largest request a connection will buffer.  WRITE_STRING and
+ * authenticated requests carry a serialised Macaroon, so this is larger
+ * than a plain TCP ADU.
+ * */
+#define SERVER_MAX_ADU_LENGTH TCP_FRAME_MAX_LENGTH
+
+/* Backlog passed to listen() */
+#define SERVER_LISTEN_BACKLOG 128
+
+/* Requests a connection may have queued for the workers before it is dropped */
+#define SERVER_MAX_PENDING 64
+
+/**
+ * Bytes of replies a connection may have waiting to be sent before its
+ * requests are held back until the client reads them
+ * */
+#define SERVER_MAX_OUTPUT (4 * SERVER_MAX_ADU_LENGTH)
+
+typedef struct {
+    int max_connections;        /* further connections are refused */
+    int nb_workers;             /* worker threads; 0 processes requests on the network thread */
+    int debug;                  /* passed to modbus_set_debug() for each connection */
+    std::atomic<bool> *stop;    /* optional, the loop returns once this is set */
+} server_config_t;
+
+/**
+ * Serve every client connecting to server_socket until config->stop is set
+ * or an unrecoverable error occurs on the listening socket.
+ *
+ * Each connection has its own modbus_t, receive buffer and shim session
+ * (so its own installed Macaroon); requests are framed on the MBAP header
+ * so a slow or partial sender never blocks the other connections.  Every
+ * complete request is passed to cheri_macaroons_shim:modbus_process_request()
+ * with shim_type.
+ *
+ * With config->nb_workers > 0, the calling thread only does network I/O
+ * and framing, and the shim pipeline runs on a pool of worker threads.  A
+ * connection is handled by at most one worker at a time, so its requests
+ * are processed, and answered, in the order they arrived.
+ *
+ * Sockets never block: replies are queued per connection and sent as the
+ * socket accepts them.  A client that does not read its replies has its
+ * further requests held back (SERVER_MAX_OUTPUT), so it never holds up
+ * the network thread or a worker.
+ *
+ * Every connection accesses mb_mapping through one mapping_seqlock_t, so
+ * reads never see a partially-written table (see mapping_seqlock.hpp).
+ *
+ * Returns 0 when stopped, -1 on error (with errno set).
+ * */
+int modbus_server_loop(int server_socket, modbus_mapping_t *mb_mapping,
+                       shim_t shim_type, const server_config_t *config);
+
+#endif /* _SERVER_LOOP_ */
@@ -0,0 +1,112 @@
+#ifndef _SHIM_ASYNC_
+#define _SHIM_ASYNC_
+
+#include <stdint.h>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/* shim support */
+#include "cheri_macaroons_shim.hpp"
+
+/**
+ * Asynchronous client API
+ *
+ * The client shim functions wait a full round trip for each response.
+ * Here a request is sent straight away and its response is matched to it
+ * later, by transaction id, so up to a window of transactions are in
+ * flight on one connection.  A sweep of a large address space then costs
+ * about one round trip per window rather than one per request.
+ *
+ * In the Macaroons modes each request carries a Macaroon attenuated to
+ * its own function and address range, exactly as the synchronous calls
+ * send it.
+ *
+ * Submitting a request when the window is full first completes the
+ * oldest transactions.  Completion calls the request's callback with what
+ * the synchronous call would have returned (e.g., the number of
+ * registers read, or -1 with errno set), after dest has been filled in.
+ *
+ * A shim_async_t is used by one thread at a time, and its ctx must not
+ * be used for synchronous calls while transactions are pending.  The
+ * window should stay below the server's SERVER_MAX_PENDING, or the
+ * server drops the connection.
+ * */
+#define SHIM_ASYNC_MAX_WINDOW 32
+#define SHIM_ASYNC_DEFAULT_WINDOW 16
+
+typedef void (*shim_async_callback_t)(void *user, int rc);
+
+typedef struct {
+    bool pending;
+    int transaction_id;
+    int function;
+    int nb;
+    void *dest;                         /* uint8_t or uint16_t array, reads only */
+    shim_async_callback_t callback;
+    void *user;
+} shim_transaction_t;
+
+typedef struct {
+    modbus_t *ctx;
+    shim_t shim_type;
+    int window;
+    int nb_pending;
+    shim_transaction_t transactions[SHIM_ASYNC_MAX_WINDOW];
+} shim_async_t;
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+/**
+ * Initialise async for the connected ctx, keeping at most window
+ * (capped to SHIM_ASYNC_MAX_WINDOW) transactions in flight.
+ * */
+void shim_async_init(shim_async_t *async, modbus_t *ctx, int window, shim_t shim_type);
+
+/**
+ * Asynchronous modbus_read_bits(), modbus_read_input_bits(), etc.
+ *
+ * dest (and src) must stay valid until the callback is called.
+ *
+ * Return the transaction id, or -1 with errno set if the request could
+ * not be sent, in which case callback is never called.
+ * */
+int shim_async_read_bits(shim_async_t *async, int addr, int nb, uint8_t *dest,
+                         shim_async_callback_t callback, void *user);
+int shim_async_read_input_bits(shim_async_t *async, int addr, int nb, uint8_t *dest,
+                               shim_async_callback_t callback, void *user);
+int shim_async_read_registers(shim_async_t *async, int addr, int nb, uint16_t *dest,
+                              shim_async_callback_t callback, void *user);
+int shim_async_read_input_registers(shim_async_t *async, int addr, int nb, uint16_t *dest,
+                                    shim_async_callback_t callback, void *user);
+int shim_async_write_bit(shim_async_t *async, int addr, int status,
+                         shim_async_callback_t callback, void *user);
+int shim_async_write_register(shim_async_t *async, int addr, uint16_t value,
+                              shim_async_callback_t callback, void *user);
+int shim_async_write_bits(shim_async_t *async, int addr, int nb, const uint8_t *src,
+                          shim_async_callback_t callback, void *user);
+int shim_async_write_registers(shim_async_t *async, int addr, int nb, const uint16_t *src,
+                               shim_async_callback_t callback, void *user);
+
+/**
+ * Wait for the next response and complete its transaction.
+ *
+ * If the connection fails (e.g., times out) or a response matches no
+ * pending transaction, every pending transaction is completed with -1.
+ *
+ * Returns the number of transactions still pending, or -1 with errno set.
+ * */
+int shim_async_poll(shim_async_t *async);
+
+/**
+ * Complete every pending transaction.
+ *
+ * Returns 0, or -1 with errno set as shim_async_poll().
+ * */
+int shim_async_flush(shim_async_t *async);
+
+#endif /* _SHIM_ASYNC_ */
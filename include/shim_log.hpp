@@ -0,0 +1,61 @@
+#ifndef _SHIM_LOG_
+#define _SHIM_LOG_
+
+/**
+ * Leveled logging for the shims
+ *
+ * SHIM_LOG_LEVEL is fixed at compile time (see CMakeLists.txt).  Messages
+ * above that level are removed by the compiler, arguments included, so
+ * disabled logging costs nothing on the request path.
+ *
+ * Enabled messages are formatted into a fixed-size ring buffer and written
+ * to stdout (stderr for errors) by a background thread, so callers never
+ * block on the terminal.  When the ring is full, messages are dropped and
+ * counted rather than slowing the caller down.
+ * */
+
+#include <stdint.h>
+
+#define SHIM_LOG_LEVEL_NONE  0
+#define SHIM_LOG_LEVEL_ERROR 1  /* unrecoverable failures */
+#define SHIM_LOG_LEVEL_INFO  2  /* start-up and state changes */
+#define SHIM_LOG_LEVEL_DEBUG 3  /* per-request decisions */
+#define SHIM_LOG_LEVEL_TRACE 4  /* function entry, decomposed requests, capabilities */
+
+#ifndef SHIM_LOG_LEVEL
+#define SHIM_LOG_LEVEL SHIM_LOG_LEVEL_INFO
+#endif
+
+/* Constant expression; use to guard multi-line dumps, e.g., print_mb_mapping() */
+#define SHIM_LOG_ENABLED(level) ((level) <= SHIM_LOG_LEVEL)
+
+#define SHIM_LOG(level, ...)                            \
+    do {                                                \
+        if(SHIM_LOG_ENABLED(level)) {                   \
+            shim_log_write((level), __VA_ARGS__);       \
+        }                                               \
+    } while(0)
+
+#define SHIM_LOG_ERROR(...) SHIM_LOG(SHIM_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define SHIM_LOG_INFO(...)  SHIM_LOG(SHIM_LOG_LEVEL_INFO, __VA_ARGS__)
+#define SHIM_LOG_DEBUG(...) SHIM_LOG(SHIM_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define SHIM_LOG_TRACE(...) SHIM_LOG(SHIM_LOG_LEVEL_TRACE, __VA_ARGS__)
+
+/* Announce entry to a shim function (replaces print_shim_info()) */
+#define SHIM_LOG_ENTER(file) SHIM_LOG_TRACE("%s\n%s:%s()", display_marker.c_str(), (file), __func__)
+
+/**
+ * Format a message into the ring buffer; a trailing newline is added.
+ * Safe to call from any thread.  Use the macros above rather than calling
+ * this directly.
+ * */
+void shim_log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Write out everything currently in the ring buffer (also run at exit) */
+void shim_log_flush(void);
+
+/* Number of messages dropped because the ring buffer was full */
+uint64_t shim_log_dropped(void);
+
+#endif /* _SHIM_LOG_ */
@@ -0,0 +1,192 @@
+#ifndef _SHIM_PIPELINE_
+#define _SHIM_PIPELINE_
+
+#include <mutex>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/* shim support */
+#include "cheri_macaroons_shim.hpp"
+#include "macaroons_shim.hpp"
+#include "cheri_shim.hpp"
+
+/**
+ * Compile-time shim pipeline
+ *
+ * A request passes through three stages, each a policy type:
+ *
+ * 1. authorisation: unwrap the request from its transport (token, MAC
+ *    session, handle) and check it against the connection's Macaroon
+ * 2. restriction: narrow the mapping to what the function needs (CHERI)
+ * 3. execution: libmodbus processes the request
+ *
+ * An authorisation or restriction policy provides
+ *
+ *   static const bool decomposes;          (needs the decomposed request)
+ *   template<typename Next> static int process(...);
+ *
+ * where process() does the stage's work and continues with
+ * Next::process(), or answers the request itself (e.g., with an
+ * exception).  An authorisation policy also provides admit(), run on the
+ * request as it arrived, before it is decomposed.  An execution policy
+ * provides process() alone.
+ *
+ * shim_pipeline_t<Authorisation, Restriction, Execution>::process()
+ * chains the three.  Every call is to an inline function known at
+ * compile time, so each configuration compiles into one straight-line
+ * function; modbus_process_request() selects the configuration for a
+ * shim_t (see the pipelines below).
+ * */
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+/* Authorisation: none */
+struct shim_no_authorisation {
+    static const bool decomposes = false;
+
+    static inline bool
+    admit(modbus_t *, uint8_t *, int *, uint8_t *, int *, shim_session_t *, int *)
+    {
+        return true;
+    }
+
+    template<typename Next>
+    static inline int
+    process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+            modbus_mapping_t *mb_mapping, const shim_request_t *request)
+    {
+        return Next::process(ctx, req, req_length, rsp, rsp_length, mb_mapping, request);
+    }
+};
+
+/* Authorisation: the Macaroon installed on the connection (macaroons_shim.hpp) */
+struct shim_macaroons_authorisation {
+    static const bool decomposes = true;
+
+    static inline bool
+    admit(modbus_t *ctx, uint8_t *req, int *req_length, uint8_t *rsp, int *rsp_length,
+          shim_session_t *session, int *rc)
+    {
+        return modbus_admit_request_macaroons(ctx, req, req_length, rsp, rsp_length,
+                                              session, rc);
+    }
+
+    template<typename Next>
+    static inline int
+    process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+            modbus_mapping_t *mb_mapping, const shim_request_t *request)
+    {
+        std::unique_lock<std::mutex> string_lock;
+        int rc;
+
+        if(!modbus_authorise_request_macaroons(ctx, req, rsp, rsp_length, mb_mapping,
+                                               request, &string_lock, &rc)) {
+            return rc;
+        }
+
+        rc = Next::process(ctx, req, req_length, rsp, rsp_length, mb_mapping, request);
+        modbus_complete_request_macaroons(mb_mapping, request, rc);
+
+        return rc;
+    }
+};
+
+/* Restriction: none */
+struct shim_no_restriction {
+    static const bool decomposes = false;
+
+    template<typename Next>
+    static inline int
+    process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+            modbus_mapping_t *mb_mapping, const shim_request_t *request)
+    {
+        return Next::process(ctx, req, req_length, rsp, rsp_length, mb_mapping, request);
+    }
+};
+
+/* Restriction: the CHERI view of the mapping for the function (cheri_shim.hpp) */
+struct shim_cheri_restriction {
+    static const bool decomposes = true;
+
+    template<typename Next>
+    static inline int
+    process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+            modbus_mapping_t *mb_mapping, const shim_request_t *request)
+    {
+        int rc;
+
+        mb_mapping = modbus_restrict_request_cheri(ctx, req, rsp, rsp_length, mb_mapping,
+                                                   request, &rc);
+        if(mb_mapping == NULL) {
+            return rc;
+        }
+
+        return Next::process(ctx, req, req_length, rsp, rsp_length, mb_mapping, request);
+    }
+};
+
+/* Execution: libmodbus, through the session's seqlock if it has one */
+struct shim_libmodbus_execution {
+    static inline int
+    process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+            modbus_mapping_t *mb_mapping, const shim_request_t *request)
+    {
+        return shim_execute_request(ctx, req, req_length, rsp, rsp_length, mb_mapping,
+                                    request->session);
+    }
+};
+
+template<typename Authorisation, typename Restriction, typename Execution>
+struct shim_pipeline_t {
+    /* what follows authorisation */
+    struct restricted_t {
+        static inline int
+        process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+                modbus_mapping_t *mb_mapping, const shim_request_t *request)
+        {
+            return Restriction::template process<Execution>(ctx, req, req_length,
+                rsp, rsp_length, mb_mapping, request);
+        }
+    };
+
+    /* Process a request that arrived on the connection owning session */
+    static inline int
+    process(modbus_t *ctx, uint8_t *req, int req_length, uint8_t *rsp, int *rsp_length,
+            modbus_mapping_t *mb_mapping, shim_session_t *session)
+    {
+        shim_request_t request;
+        int rc;
+
+        if(!Authorisation::admit(ctx, req, &req_length, rsp, rsp_length, session, &rc)) {
+            return rc;
+        }
+
+        /* decode the request once, if any stage inspects it; every stage shares this copy */
+        if(Authorisation::decomposes || Restriction::decomposes) {
+            modbus_decompose_request(ctx, req, &request.offset, &request.slave_id,
+                                     &request.function, &request.addr, &request.nb,
+                                     &request.addr_wr, &request.nb_wr);
+        }
+        request.session = session;
+
+        return Authorisation::template process<restricted_t>(ctx, req, req_length,
+            rsp, rsp_length, mb_mapping, &request);
+    }
+};
+
+/* The pipeline for each shim_t */
+typedef shim_pipeline_t<shim_no_authorisation, shim_no_restriction,
+                        shim_libmodbus_execution> shim_none_pipeline_t;
+typedef shim_pipeline_t<shim_no_authorisation, shim_cheri_restriction,
+                        shim_libmodbus_execution> shim_cheri_pipeline_t;
+typedef shim_pipeline_t<shim_macaroons_authorisation, shim_no_restriction,
+                        shim_libmodbus_execution> shim_macaroons_pipeline_t;
+typedef shim_pipeline_t<shim_macaroons_authorisation, shim_cheri_restriction,
+                        shim_libmodbus_execution> shim_cheri_macaroons_pipeline_t;
+
+#endif /* _SHIM_PIPELINE_ */
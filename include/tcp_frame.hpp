@@ -0,0 +1,316 @@
+#ifndef _TCP_FRAME_
+#define _TCP_FRAME_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* for Modbus */
+extern "C" {
+    #include <modbus/modbus.h>
+}
+
+/**
+ * Modbus/TCP framing shared by the client and server shims
+ *
+ * An authenticated request carries a serialised Macaroon and an ordinary
+ * Modbus PDU in a single ADU, so a shimmed call costs one round trip:
+ *
+ *   MBAP header (7) | MODBUS_FC_AUTHENTICATED | token length (2) | token | PDU
+ *
+ * The server verifies the token, unwraps the ADU in place into a plain
+ * request for the inner PDU, and answers it as usual.  The response is
+ * the ordinary response (or exception) for the inner function code.
+ *
+ * MODBUS_FC_AUTHENTICATED is in the user-defined function code range, so
+ * a server without the Macaroons shim answers it with
+ * MODBUS_EXCEPTION_ILLEGAL_FUNCTION and plain requests are unaffected.
+ *
+ * The shims reserve the function codes 0x41-0x47 defined in this file.
+ * 0x48, the last user-defined code, is left unassigned: the shimmed test
+ * clients send it as an invalid function code.
+ * */
+#define MODBUS_FC_AUTHENTICATED 0x41
+
+/**
+ * Exception replied when a shim refuses a request (no valid Macaroon,
+ * caveats not satisfied, capability check failed).  It follows the
+ * exceptions defined by Modbus, so a client sees errno == EMBXNOTAUTH.
+ * */
+#define MODBUS_EXCEPTION_NOT_AUTHORISED 0x0C
+#define EMBXNOTAUTH (MODBUS_ENOBASE + MODBUS_EXCEPTION_NOT_AUTHORISED)
+
+/**
+ * Exception replied to a request sent with a token handle the server no
+ * longer knows (see below), so a client sees errno == EMBXEVICTED.
+ * */
+#define MODBUS_EXCEPTION_HANDLE_EVICTED 0x0D
+#define EMBXEVICTED (MODBUS_ENOBASE + MODBUS_EXCEPTION_HANDLE_EVICTED)
+
+/**
+ * Chunked token transfer
+ *
+ * A token larger than an authenticated ADU can carry is sent in chunks
+ * ahead of the request it authorises, and a server Macaroon larger than
+ * tab_string is read in chunks.  Chunks are pipelined: up to
+ * TOKEN_CHUNK_WINDOW are in flight before the first response is read.
+ *
+ *   write request:   MODBUS_FC_WRITE_TOKEN_CHUNK | flags | offset (2) | data
+ *   write response:  MODBUS_FC_WRITE_TOKEN_CHUNK | flags | offset (2)
+ *   read request:    MODBUS_FC_READ_TOKEN_CHUNK | offset (2) | length (1)
+ *   read response:   MODBUS_FC_READ_TOKEN_CHUNK | total (2) | offset (2) | data
+ *
+ * The server reassembles written chunks in the connection's session and
+ * installs the token when the TOKEN_CHUNK_LAST chunk arrives.  Chunks
+ * must arrive in order, starting with a TOKEN_CHUNK_FIRST chunk.
+ * */
+#define MODBUS_FC_WRITE_TOKEN_CHUNK 0x42
+#define MODBUS_FC_READ_TOKEN_CHUNK 0x43
+
+#define TOKEN_CHUNK_FIRST 0x01
+#define TOKEN_CHUNK_LAST 0x02
+
+#define TOKEN_WRITE_CHUNK_HEADER_LENGTH 4
+#define TOKEN_READ_CHUNK_HEADER_LENGTH 5
+#define TOKEN_WRITE_CHUNK_MAX_DATA (MODBUS_MAX_PDU_LENGTH - TOKEN_WRITE_CHUNK_HEADER_LENGTH)
+#define TOKEN_READ_CHUNK_MAX_DATA (MODBUS_MAX_PDU_LENGTH - TOKEN_READ_CHUNK_HEADER_LENGTH)
+
+/* Largest token either side will transfer in chunks */
+#define TOKEN_MAX_LENGTH 0xFFFF
+
+/* Chunks in flight; well below SERVER_MAX_PENDING */
+#define TOKEN_CHUNK_WINDOW 16
+
+/**
+ * Session MAC mode
+ *
+ * Sending a token with every request costs its bytes on the wire and its
+ * verification on the server.  Instead, a client may open a session bound
+ * to the Macaroon installed on its connection:
+ *
+ *   open request:     MODBUS_FC_SESSION_OPEN (usually authenticated)
+ *   open response:    MODBUS_FC_SESSION_OPEN | nonce (8)
+ *
+ * Both sides then derive the session key
+ *
+ *   HMAC(signature of the installed Macaroon, "modbus-session" | nonce)
+ *
+ * and each later request carries a sequence number and a truncated MAC
+ * instead of a token:
+ *
+ *   session request:  MODBUS_FC_SESSION | sequence (4) | MAC (8) | PDU
+ *
+ * The MAC is the first SESSION_MAC_LENGTH bytes of HMAC(session key,
+ * unit id | sequence | PDU).  Sequence numbers start at 1 and must
+ * increase, so a request cannot be replayed, and the nonce is fresh for
+ * every session, so nor can a whole session.  The server unwraps a
+ * session request in place, as an authenticated one, and checks it
+ * against the caveats of the Macaroon the session was opened on.
+ * Installing another Macaroon closes the session.
+ * */
+#define MODBUS_FC_SESSION_OPEN 0x44
+#define MODBUS_FC_SESSION 0x45
+
+#define SESSION_NONCE_LENGTH 8
+#define SESSION_MAC_LENGTH 8
+
+/* function code, sequence number and MAC preceding the PDU */
+#define SESSION_PREFIX_LENGTH (1 + 4 + SESSION_MAC_LENGTH)
+
+/**
+ * Token handles
+ *
+ * A client may exchange the Macaroon installed on its connection for a
+ * handle, under which the server keeps the Macaroon's compiled caveats
+ * (see token_handle.hpp), and then send requests with the handle alone:
+ *
+ *   install request:  MODBUS_FC_INSTALL_HANDLE
+ *   install response: MODBUS_FC_INSTALL_HANDLE | handle (4)
+ *   handle request:   MODBUS_FC_HANDLE | handle (4) | PDU
+ *
+ * The server unwraps a handle request in place, as an authenticated one,
+ * and checks it against the caveats of the handle's Macaroon.  A handle
+ * the server has evicted, or never issued to the connection, is answered
+ * with MODBUS_EXCEPTION_HANDLE_EVICTED.  The server keeps no signature
+ * for a handle, so a session cannot be opened on its Macaroon: after a
+ * handle request, MODBUS_FC_SESSION_OPEN is refused until a token is
+ * installed again.
+ * */
+#define MODBUS_FC_INSTALL_HANDLE 0x46
+#define MODBUS_FC_HANDLE 0x47
+
+/* function code and handle preceding the PDU */
+#define HANDLE_PREFIX_LENGTH 5
+
+/* MBAP header: transaction id (2), protocol id (2), length (2), unit id (1) */
+#define MBAP_LENGTH_OFFSET 4
+#define MBAP_PREFIX_LENGTH 6
+#define MBAP_HEADER_LENGTH 7
+
+/* function code and token length preceding the token */
+#define AUTHENTICATED_PREFIX_LENGTH 3
+
+/* Largest authenticated ADU: a maximum size token wrapping a maximum size PDU */
+#define TCP_FRAME_MAX_LENGTH (MODBUS_TCP_MAX_ADU_LENGTH + AUTHENTICATED_PREFIX_LENGTH + \
+                              MODBUS_MAX_STRING_LENGTH)
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+/**
+ * Send token and pdu as one authenticated ADU on the connected ctx.
+ *
+ * Returns the transaction id used, or -1 (with errno set) on error.
+ * */
+int tcp_frame_send_authenticated(modbus_t *ctx,
+                                 const uint8_t *token, int token_length,
+                                 const uint8_t *pdu, int pdu_length);
+
+/**
+ * Send pdu in a session (see above), as request sequence with its MAC,
+ * without waiting for the response.
+ *
+ * Returns the transaction id used, or -1 (with errno set) on error.
+ * */
+int tcp_frame_send_session(modbus_t *ctx, uint32_t sequence,
+                           const uint8_t mac[SESSION_MAC_LENGTH],
+                           const uint8_t *pdu, int pdu_length);
+
+/**
+ * Send pdu with a token handle (see above), without waiting for the
+ * response.
+ *
+ * Returns the transaction id used, or -1 (with errno set) on error.
+ * */
+int tcp_frame_send_handle(modbus_t *ctx, uint32_t handle,
+                          const uint8_t *pdu, int pdu_length);
+
+/* The unit id requests sent on ctx are addressed to */
+uint8_t tcp_frame_unit_id(modbus_t *ctx);
+
+/**
+ * Send pdu as a plain ADU on the connected ctx, without waiting for the
+ * response.
+ *
+ * Returns the transaction id used, or -1 (with errno set) on error.
+ * */
+int tcp_frame_send(modbus_t *ctx, const uint8_t *pdu, int pdu_length);
+
+/**
+ * Receive the next ADU on ctx, whatever transaction it answers, framed
+ * by its MBAP length, into rsp, which must hold TCP_FRAME_MAX_LENGTH
+ * bytes.  The response is not checked (see tcp_frame_check_response()).
+ *
+ * Returns the length of the ADU, or -1 with errno set (ETIMEDOUT if
+ * nothing arrives within the ctx response timeout).
+ * */
+int tcp_frame_receive_adu(modbus_t *ctx, uint8_t *rsp);
+
+/**
+ * Check the response rsp answers transaction_id and function.  offset is
+ * the header length (the offset of the function code).
+ *
+ * Returns rsp_length, or -1 with errno set as tcp_frame_receive().
+ * */
+int tcp_frame_check_response(const uint8_t *rsp, int rsp_length, int offset,
+                             int transaction_id, int function);
+
+/**
+ * Receive one ADU of any function code, framed by its MBAP length, into
+ * rsp, which must hold TCP_FRAME_MAX_LENGTH bytes.  Used for responses
+ * libmodbus cannot frame itself (e.g., token chunks).
+ *
+ * Returns and reports errors as tcp_frame_receive().
+ * */
+int tcp_frame_receive_raw(modbus_t *ctx, int transaction_id, int function, uint8_t *rsp);
+
+/**
+ * Receive the response to an authenticated request into rsp, which must
+ * hold MODBUS_TCP_MAX_ADU_LENGTH bytes.
+ *
+ * Returns the length of the response, or -1 with errno set if the
+ * response is an exception (MODBUS_ENOBASE + exception code) or does not
+ * answer transaction_id and function (EMBBADDATA).  An exception to
+ * MODBUS_FC_AUTHENTICATED, MODBUS_FC_SESSION or MODBUS_FC_HANDLE itself
+ * (a request the server could not unwrap) is reported the same way.
+ * */
+int tcp_frame_receive(modbus_t *ctx, int transaction_id, int function, uint8_t *rsp);
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+/**
+ * Locate the token in an authenticated request.
+ *
+ * offset is the header length (the offset of the function code).
+ * Returns false if the request is malformed, or if the PDU it wraps is
+ * longer than MODBUS_MAX_PDU_LENGTH.
+ * */
+bool tcp_frame_parse_authenticated(const uint8_t *req, int req_length, int offset,
+                                   const uint8_t **token, int *token_length);
+
+/**
+ * Locate the sequence number and MAC in a session request.
+ *
+ * offset is the header length (the offset of the function code).
+ * Returns false if the request is malformed, or if the PDU it wraps is
+ * longer than MODBUS_MAX_PDU_LENGTH.
+ * */
+bool tcp_frame_parse_session(const uint8_t *req, int req_length, int offset,
+                             uint32_t *sequence, const uint8_t **mac);
+
+/**
+ * Locate the handle in a handle request.
+ *
+ * offset is the header length (the offset of the function code).
+ * Returns false if the request is malformed, or if the PDU it wraps is
+ * longer than MODBUS_MAX_PDU_LENGTH.
+ * */
+bool tcp_frame_parse_handle(const uint8_t *req, int req_length, int offset,
+                            uint32_t *handle);
+
+/**
+ * Build the response to req carrying pdu into rsp.
+ *
+ * Returns the length of the response.
+ * */
+int tcp_frame_build_response(const uint8_t *req, int offset,
+                             const uint8_t *pdu, int pdu_length, uint8_t *rsp);
+
+/**
+ * Build the exception response to req, for function (the function code
+ * refused), into rsp.
+ *
+ * Returns the length of the response.
+ * */
+int tcp_frame_build_exception(const uint8_t *req, int offset, int function,
+                              int exception_code, uint8_t *rsp);
+
+/**
+ * Rewrite an authenticated request in place into the plain request it
+ * wraps, fixing the MBAP length.  The token is overwritten, so it must
+ * have been consumed already.
+ *
+ * Returns the length of the plain request.
+ * */
+int tcp_frame_unwrap_authenticated(uint8_t *req, int req_length, int offset,
+                                   int token_length);
+
+/**
+ * Rewrite a session request in place into the plain request it wraps,
+ * as tcp_frame_unwrap_authenticated().
+ *
+ * Returns the length of the plain request.
+ * */
+int tcp_frame_unwrap_session(uint8_t *req, int req_length, int offset);
+
+/**
+ * Rewrite a handle request in place into the plain request it wraps, as
+ * tcp_frame_unwrap_authenticated().
+ *
+ * Returns the length of the plain request.
+ * */
+int tcp_frame_unwrap_handle(uint8_t *req, int req_length, int offset);
+
+#endif /* _TCP_FRAME_ */
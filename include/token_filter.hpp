@@ -0,0 +1,66 @@
+#ifndef _TOKEN_FILTER_
+#define _TOKEN_FILTER_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hmac_sha256.hpp"
+#include "tcp_frame.hpp"
+
+/**
+ * Admission filter for incoming tokens
+ *
+ * Junk written as a token (by an attacker or a buggy client) should cost
+ * as little as possible.  Before a token is parsed or any HMAC computed,
+ * it passes through cheap stages, cheapest first:
+ *
+ * 1. length: between the smallest possible V1 Macaroon and
+ *    TOKEN_MAX_LENGTH
+ * 2. structure: the token must start like a V1 Macaroon, with a hex
+ *    packet length
+ * 3. alphabet: every character must be base64
+ * 4. negative cache: the token must not have been rejected recently
+ *
+ * Every token the server rejects is remembered by its hash, so the same
+ * bad token sent again is dropped at stage 4.  The cache is cleared when
+ * the server Macaroon changes, as a rejected token may verify under the
+ * new key.  Nothing here allocates or locks.
+ * */
+
+/* location, identifier and signature packets, with empty values, base64 encoded */
+#define TOKEN_FILTER_MIN_DECODED (14 + 16 + 15 + HMAC_SHA256_LENGTH)
+#define TOKEN_FILTER_MIN_LENGTH ((TOKEN_FILTER_MIN_DECODED * 4 + 2) / 3)
+#define TOKEN_FILTER_MAX_LENGTH TOKEN_MAX_LENGTH
+
+#define TOKEN_FILTER_CACHE_SIZE 1024    /* must be a power of two */
+
+typedef enum {
+    TOKEN_FILTER_PASS,
+    TOKEN_FILTER_LENGTH,
+    TOKEN_FILTER_STRUCTURE,
+    TOKEN_FILTER_ALPHABET,
+    TOKEN_FILTER_RECENTLY_REJECTED,
+    TOKEN_FILTER_COUNT
+} token_filter_result_t;
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+/**
+ * Run token through the filter.  hash is set for token_filter_reject()
+ * once the token has been hashed (stage 4), and 0 before.
+ *
+ * Returns TOKEN_FILTER_PASS, or the stage that dropped the token.
+ * */
+token_filter_result_t token_filter_check(const uint8_t *token, size_t length, uint64_t *hash);
+
+/* Remember a token (by its hash) that failed verification */
+void token_filter_reject(uint64_t hash);
+
+/* Forget every rejected token */
+void token_filter_clear(void);
+
+const char *get_token_filter_name(token_filter_result_t result);
+
+#endif /* _TOKEN_FILTER_ */
@@ -0,0 +1,71 @@
+#ifndef _TOKEN_HANDLE_
+#define _TOKEN_HANDLE_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "caveats.hpp"
+
+/**
+ * Server table of verified tokens, by handle
+ *
+ * A client may exchange the Macaroon installed on its connection for a
+ * small numeric handle (see tcp_frame.hpp) and send later requests with
+ * the handle alone.  The table keeps, for each handle, the compiled
+ * caveats of its Macaroon and the connection it was issued to; a handle
+ * used on any other connection is unknown.
+ *
+ * The table has a fixed capacity, so memory stays bounded however many
+ * clients hold handles.  Each entry fills one cache line.  Once full,
+ * installing a token evicts another, least recently used (LRU) or by a
+ * CLOCK sweep, which approximates LRU but costs a lookup only a bit
+ * write.  A handle that has been evicted is unknown from then on; the
+ * client installs its token again.
+ *
+ * The table is shared by every connection and protected by a mutex.
+ * */
+#define TOKEN_HANDLE_DEFAULT_CAPACITY 4096
+#define TOKEN_HANDLE_MAX_CAPACITY (1 << 20)
+#define TOKEN_HANDLE_CACHE_LINE 64
+
+typedef enum {
+    TOKEN_HANDLE_LRU,
+    TOKEN_HANDLE_CLOCK
+} token_handle_policy_t;
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+/**
+ * (Re)initialise the table with capacity entries, evicting by policy.
+ * Every handle issued before is forgotten.  Without this, the table is
+ * initialised on first use with TOKEN_HANDLE_DEFAULT_CAPACITY entries
+ * and TOKEN_HANDLE_CLOCK.
+ *
+ * Returns 0, or -1 with errno set.
+ * */
+int token_handle_table_init(int capacity, token_handle_policy_t policy);
+
+/**
+ * Add the caveats of a verified token, for the connection owner, evicting
+ * an entry if the table is full.
+ *
+ * Returns the new handle, never 0, or 0 with errno set.
+ * */
+uint32_t token_handle_insert(uint64_t owner, const compiled_caveats_t *caveats);
+
+/**
+ * Find handle, issued to owner, and copy out its caveats.
+ *
+ * Returns false if the handle is unknown: evicted, never issued, or
+ * issued to another connection.
+ * */
+bool token_handle_lookup(uint32_t handle, uint64_t owner, compiled_caveats_t *caveats);
+
+/* Entries evicted since the table was initialised */
+uint64_t token_handle_get_evictions(void);
+
+const char *get_token_handle_policy_name(token_handle_policy_t policy);
+
+#endif /* _TOKEN_HANDLE_ */
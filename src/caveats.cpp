@@ -0,0 +1,418 @@
+#include "caveats.hpp"
+
+#include <string.h>
+
+/* Longest varint of a 32-bit value (plus one) */
+#define VARINT_MAX_LENGTH 5
+
+/* Registry entry for a caveat type */
+typedef struct {
+    const char *prefix;         /* textual form is prefix followed by a decimal value */
+    size_t prefix_length;
+    bool (*parse)(const char *value, size_t length, caveat_t *caveat);
+    unsigned char tag;          /* binary form is tag followed by varints */
+    bool (*decode)(const uint8_t *payload, size_t length, caveat_t *caveat);
+    void (*fold)(caveat_t *into, const caveat_t *caveat);
+    bool (*check)(const caveat_t *predicate, const caveat_request_t *request);
+    caveat_result_t failure;    /* reported when the check fails or the type is absent */
+} caveat_handler_t;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/**
+ * Parse an unsigned 32-bit decimal value, e.g., the N in "function = N".
+ * Unlike std::stoi this neither allocates nor throws.
+ * */
+static bool
+parse_uint32(const char *value, size_t length, uint32_t *result)
+{
+    uint64_t n = 0;
+
+    if(length == 0 || length > 10) {
+        return false;
+    }
+
+    for(size_t i = 0; i < length; i++) {
+        if(value[i] < '0' || value[i] > '9') {
+            return false;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+
+    if(n > 0xFFFFFFFF) {
+        return false;
+    }
+
+    *result = (uint32_t)n;
+    return true;
+}
+
+/* Append value as a varint of value + 1 */
+static void
+put_varint(std::string *out, uint32_t value)
+{
+    uint64_t v = (uint64_t)value + 1;
+
+    while(v >= 0x80) {
+        out->push_back((char)(0x80 | (v & 0x7F)));
+        v >>= 7;
+    }
+    out->push_back((char)v);
+}
+
+/**
+ * Decode a varint written by put_varint() from the start of payload.
+ * Only the shortest encoding is accepted, so every value has exactly one
+ * (and no encoding contains a NUL).
+ *
+ * Returns the number of bytes consumed, or 0 if it is malformed.
+ * */
+static size_t
+get_varint(const uint8_t *payload, size_t length, uint32_t *value)
+{
+    uint64_t v = 0;
+
+    for(size_t i = 0; i < length && i < VARINT_MAX_LENGTH; i++) {
+        v |= (uint64_t)(payload[i] & 0x7F) << (7 * i);
+        if(!(payload[i] & 0x80)) {
+            /* a final 0x00 after a continuation adds nothing: an overlong encoding */
+            if(v == 0 || v > 0x100000000ULL || (i > 0 && payload[i] == 0)) {
+                return 0;
+            }
+            *value = (uint32_t)(v - 1);
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* function = N */
+static bool
+parse_function_caveat(const char *value, size_t length, caveat_t *caveat)
+{
+    return parse_uint32(value, length, &caveat->function_mask);
+}
+
+/* CAVEAT_TAG_FUNCTION | varint(mask + 1) */
+static bool
+decode_function_caveat(const uint8_t *payload, size_t length, caveat_t *caveat)
+{
+    size_t n = get_varint(payload, length, &caveat->function_mask);
+
+    return n != 0 && n == length;
+}
+
+static void
+fold_function_caveat(caveat_t *into, const caveat_t *caveat)
+{
+    into->function_mask &= caveat->function_mask;
+}
+
+static bool
+check_function_caveat(const caveat_t *predicate, const caveat_request_t *request)
+{
+    if(request->function < 0 || request->function >= 32) {
+        return false;
+    }
+
+    return (predicate->function_mask & (1u<<request->function)) != 0;
+}
+
+/* address = N */
+static bool
+parse_address_caveat(const char *value, size_t length, caveat_t *caveat)
+{
+    uint32_t ac;
+
+    if(!parse_uint32(value, length, &ac)) {
+        return false;
+    }
+
+    caveat->addr_min = (0xFFFF0000 & ac)>>16;
+    caveat->addr_max = 0x0000FFFF & ac;
+    return true;
+}
+
+/* CAVEAT_TAG_ADDRESS | varint(min + 1) | varint(max + 1) */
+static bool
+decode_address_caveat(const uint8_t *payload, size_t length, caveat_t *caveat)
+{
+    uint32_t min;
+    uint32_t max;
+    size_t n;
+    size_t m;
+
+    n = get_varint(payload, length, &min);
+    if(n == 0) {
+        return false;
+    }
+    m = get_varint(payload + n, length - n, &max);
+    if(m == 0 || n + m != length || min > 0xFFFF || max > 0xFFFF) {
+        return false;
+    }
+
+    caveat->addr_min = (uint16_t)min;
+    caveat->addr_max = (uint16_t)max;
+    return true;
+}
+
+static void
+fold_address_caveat(caveat_t *into, const caveat_t *caveat)
+{
+    into->addr_min = (caveat->addr_min > into->addr_min) ? caveat->addr_min : into->addr_min;
+    into->addr_max = (caveat->addr_max < into->addr_max) ? caveat->addr_max : into->addr_max;
+}
+
+static bool
+check_address_caveat(const caveat_t *predicate, const caveat_request_t *request)
+{
+    return request->addr_min >= predicate->addr_min &&
+           request->addr_max <= predicate->addr_max;
+}
+
+/**
+ * The caveat registry, indexed by caveat_type_t
+ *
+ * To add a caveat type, add it to caveat_type_t and give it an entry here
+ * and in caveat_dispatch below.
+ * */
+static const caveat_handler_t caveat_registry[CAVEAT_TYPE_COUNT] = {
+    /* CAVEAT_FUNCTION */
+    {"function = ", 11, parse_function_caveat,
+     CAVEAT_TAG_FUNCTION, decode_function_caveat,
+     fold_function_caveat, check_function_caveat, CAVEAT_FAIL_FUNCTION},
+    /* CAVEAT_ADDRESS */
+    {"address = ", 10, parse_address_caveat,
+     CAVEAT_TAG_ADDRESS, decode_address_caveat,
+     fold_address_caveat, check_address_caveat, CAVEAT_FAIL_ADDRESS},
+};
+
+/* Both a function and an address caveat are required to authorise a request */
+static const uint32_t caveat_required = (1u<<CAVEAT_FUNCTION) | (1u<<CAVEAT_ADDRESS);
+
+/**
+ * Maps the first byte of a caveat (its tag, or the first letter of its
+ * textual prefix) to its type, so a caveat is matched against a single
+ * registry entry rather than every known prefix.
+ * */
+static int
+caveat_dispatch(unsigned char first)
+{
+    switch(first) {
+        case CAVEAT_TAG_FUNCTION:
+        case 'f':
+            return CAVEAT_FUNCTION;
+        case CAVEAT_TAG_ADDRESS:
+        case 'a':
+            return CAVEAT_ADDRESS;
+        default:
+            return -1;
+    }
+}
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+/**
+ * Three functions to create_function_caveat
+ * In all cases, the bitfield is returned in the binary caveat encoding
+ * 1. Input: READ-ONLY or WRITE-ONLY
+ * 2. Input: Single int function code
+ * 3. Input: Vector of ints of multiple function codes
+ * */
+std::string
+create_function_caveat_common(uint32_t fc) {
+    std::string caveat(1, (char)CAVEAT_TAG_FUNCTION);
+
+    put_varint(&caveat, fc);
+    return caveat;
+}
+
+std::string
+create_function_caveat(std::string function_code) {
+    uint32_t fc = 0;
+
+    if(function_code == "READ-ONLY") {
+        fc |= 1<<MODBUS_FC_READ_COILS;
+        fc |= 1<<MODBUS_FC_READ_DISCRETE_INPUTS;
+        fc |= 1<<MODBUS_FC_READ_HOLDING_REGISTERS;
+        fc |= 1<<MODBUS_FC_READ_INPUT_REGISTERS;
+        fc |= 1<<MODBUS_FC_READ_EXCEPTION_STATUS;
+        fc |= 1<<MODBUS_FC_REPORT_SLAVE_ID;
+        fc |= 1<<MODBUS_FC_READ_STRING;
+    } else if(function_code == "WRITE-ONLY") {
+        fc |= 1<<MODBUS_FC_WRITE_SINGLE_COIL;
+        fc |= 1<<MODBUS_FC_WRITE_SINGLE_REGISTER;
+        fc |= 1<<MODBUS_FC_WRITE_MULTIPLE_COILS;
+        fc |= 1<<MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+        fc |= 1<<MODBUS_FC_MASK_WRITE_REGISTER;
+        fc |= 1<<MODBUS_FC_WRITE_STRING;
+    } else {
+        return "";
+    }
+
+    return create_function_caveat_common(fc);
+}
+
+std::string
+create_function_caveat(int function_code) {
+    return create_function_caveat_common(1<<function_code);
+}
+
+std::string
+create_function_caveat(std::vector<int> function_codes) {
+    uint32_t fc = 0;
+    for (int code : function_codes) {
+        fc |= 1<<code;
+    }
+    return create_function_caveat_common(fc);
+}
+
+/**
+ * Create an address caveat, in the binary caveat encoding
+ *
+ * The textual equivalent is address = 0xABCDEFGH, where
+ * ABCD is the min address
+ * EFGH is the max address
+ * */
+std::string
+create_address_caveat(uint16_t min, uint16_t max)
+{
+    std::string caveat(1, (char)CAVEAT_TAG_ADDRESS);
+
+    put_varint(&caveat, min);
+    put_varint(&caveat, max);
+    return caveat;
+}
+
+/******************
+ * COMMON FUNCTIONS
+ *****************/
+
+/**
+ * Based on function, address, and number, calculate
+ * the maximum address expected to be accessed.
+ *
+ * For bitwise operations (e.g., read_bits), round up
+ * to the nearest byte
+ * */
+uint16_t
+find_max_address(int function, uint16_t addr, int nb)
+{
+    uint16_t addr_max;
+
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            addr_max = addr + (nb / 8) + ((nb % 8) ? 1 : 0);
+            break;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            addr_max = addr + (nb * 2);
+            break;
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_REPORT_SLAVE_ID:
+        case MODBUS_FC_READ_EXCEPTION_STATUS:
+            addr_max = addr;
+            break;
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+            addr_max = addr + 2;
+            break;
+        case MODBUS_FC_WRITE_STRING:
+            addr_max = addr + nb;
+            break;
+        default:
+            addr_max = addr;
+    }
+
+    return addr_max;
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+void
+compiled_caveats_init(compiled_caveats_t *caveats)
+{
+    caveats->present = 0;
+
+    /* identities for folding */
+    caveats->predicates[CAVEAT_FUNCTION].function_mask = 0xFFFFFFFF;
+    caveats->predicates[CAVEAT_ADDRESS].addr_min = 0x0000;
+    caveats->predicates[CAVEAT_ADDRESS].addr_max = 0xFFFF;
+}
+
+bool
+compiled_caveats_add(compiled_caveats_t *caveats, const char *caveat, size_t length)
+{
+    const caveat_handler_t *handler;
+    caveat_t parsed;
+    int type;
+
+    if(length == 0) {
+        return false;
+    }
+
+    type = caveat_dispatch((unsigned char)caveat[0]);
+    if(type < 0) {
+        return false;
+    }
+
+    handler = &caveat_registry[type];
+    if((unsigned char)caveat[0] == handler->tag) {
+        if(!handler->decode((const uint8_t *)caveat + 1, length - 1, &parsed)) {
+            return false;
+        }
+    } else {
+        if(length < handler->prefix_length ||
+           memcmp(caveat, handler->prefix, handler->prefix_length) != 0) {
+            return false;
+        }
+
+        if(!handler->parse(caveat + handler->prefix_length,
+                           length - handler->prefix_length, &parsed)) {
+            return false;
+        }
+    }
+
+    handler->fold(&caveats->predicates[type], &parsed);
+    caveats->present |= 1u<<type;
+
+    return true;
+}
+
+caveat_result_t
+check_caveats(const compiled_caveats_t *caveats, int function, uint16_t addr, int nb)
+{
+    caveat_request_t request;
+
+    request.function = function;
+    request.addr_min = addr;
+    request.addr_max = find_max_address(function, addr, nb);
+
+    for(int type = 0; type < CAVEAT_TYPE_COUNT; type++) {
+        const caveat_handler_t *handler = &caveat_registry[type];
+
+        if(!(caveats->present & (1u<<type))) {
+            if(caveat_required & (1u<<type)) {
+                return handler->failure;
+            }
+            continue;
+        }
+
+        if(!handler->check(&caveats->predicates[type], &request)) {
+            return handler->failure;
+        }
+    }
+
+    return CAVEAT_PASS;
+}
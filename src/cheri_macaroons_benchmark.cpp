@@ -0,0 +1,782 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+extern "C" {
+    #include <modbus/modbus.h>
+    #include "unit-test.h"
+}
+
+/* CHERI Macaroons */
+#include "cheri_macaroons_shim.hpp"
+#include "macaroons_shim.hpp"
+#include "server_loop.hpp"
+#include "shim_async.hpp"
+
+/**
+ * Loopback benchmark for the four shim modes
+ *
+ * For each shim_t, a server (modbus_server_loop() on its own thread) and
+ * a number of client threads run in this process, connected over
+ * 127.0.0.1.  Each client issues a fixed number of calls, cycling
+ * through a mix of the function codes exercised by cheri_macaroons_client,
+ * and the latency of every call is recorded.
+ *
+ * For each mode and function code we report calls/sec and p50/p99/p999
+ * latency, plus the number of heap allocations (operator new) made by
+ * the server (network and worker threads) per call and the number of
+ * requests the server refused.  A "call" is one client API call; in the
+ * Macaroons modes the token travels with the request in the same ADU.
+ *
+ * With a pipeline depth above 1, each client issues its calls through
+ * the asynchronous API (shim_async.hpp), keeping that many in flight, and
+ * a call's latency runs from sending its request to its completion.
+ *
+ * With -s, each Macaroons client opens a MAC session (see tcp_frame.hpp)
+ * once connected, on a Macaroon attenuated to the function codes of the
+ * mix and the addresses they use, and its requests carry a MAC instead of
+ * a token.
+ * With -H, each Macaroons client sends its synchronous calls with token
+ * handles, and -h sets the capacity of the server's handle table, to
+ * measure eviction.
+ *
+ * Build with -DSHIM_LOG_LEVEL=NONE (or ERROR) for meaningful numbers.
+ * */
+
+#define BENCH_DEFAULT_PORT 1503
+#define BENCH_DEFAULT_CLIENTS 1
+#define BENCH_DEFAULT_WORKERS 0
+#define BENCH_DEFAULT_CALLS 10000
+#define BENCH_DEFAULT_DEPTH 1
+#define BENCH_WARMUP_CALLS 100
+#define BENCH_MAX_FUNCTIONS 32
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* Latencies recorded by one client for one function code, in ns */
+typedef std::vector<uint32_t> latencies_t;
+
+typedef struct {
+    modbus_t *ctx;
+    shim_t shim_type;
+    int depth;                              /* calls in flight */
+    const std::vector<int> *mix;
+    std::vector<latencies_t> latencies;     /* indexed like mix */
+    std::vector<int> errors;                /* indexed like mix */
+} client_t;
+
+/* A pipelined call awaiting its completion */
+typedef struct {
+    client_t *client;
+    size_t index;                           /* in mix */
+    bool record;
+    bench_clock::time_point start;
+} pending_call_t;
+
+/*********
+ * GLOBALS
+ *********/
+
+/**
+ * Allocation counting
+ *
+ * Only allocations made by the server threads are counted, so the main
+ * and client threads sharing this process do not distort the figure.
+ * Threads count by default, as the server's workers are started by the
+ * server loop itself.
+ * */
+static thread_local bool count_allocations_ = true;
+static std::atomic<uint64_t> server_allocations_(0);
+
+void *
+operator new(size_t size)
+{
+    void *p;
+
+    if(count_allocations_) {
+        server_allocations_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    p = malloc(size ? size : 1);
+    if(p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static const char *
+get_shim_name(shim_t shim_type)
+{
+    switch(shim_type) {
+        case NONE:
+            return "NONE";
+        case CHERI:
+            return "CHERI";
+        case MACAROONS:
+            return "MACAROONS";
+        case CHERI_MACAROONS:
+            return "CHERI_MACAROONS";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+static bool
+parse_shim(const char *name, shim_t *shim_type)
+{
+    const shim_t shims[] = {NONE, CHERI, MACAROONS, CHERI_MACAROONS};
+
+    for(shim_t s : shims) {
+        if(strcmp(name, get_shim_name(s)) == 0) {
+            *shim_type = s;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+is_supported_function(int function)
+{
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Function codes the asynchronous API (and so a pipelined run) supports */
+static bool
+is_async_function(int function)
+{
+    return is_supported_function(function) &&
+           function != MODBUS_FC_MASK_WRITE_REGISTER &&
+           function != MODBUS_FC_WRITE_AND_READ_REGISTERS;
+}
+
+/**
+ * Parse a comma-separated list of function codes, e.g., "0x03,0x03,0x10".
+ * A code listed several times is issued proportionally more often.
+ * */
+static bool
+parse_mix(const char *list, std::vector<int> *mix)
+{
+    char *end;
+    long function;
+
+    mix->clear();
+    while(*list != '\0') {
+        function = strtol(list, &end, 0);
+        if(end == list || !is_supported_function((int)function) ||
+           mix->size() == BENCH_MAX_FUNCTIONS) {
+            return false;
+        }
+        mix->push_back((int)function);
+
+        list = end;
+        if(*list == ',') {
+            list++;
+        }
+    }
+
+    return !mix->empty();
+}
+
+/* Issue one call of the given function code, as cheri_macaroons_client does */
+static int
+issue_call(modbus_t *ctx, int function, shim_t shim_type)
+{
+    uint8_t bits[UT_BITS_NB];
+    uint16_t registers[UT_REGISTERS_NB_MAX];
+
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+            return modbus_read_bits(ctx, UT_BITS_ADDRESS, UT_BITS_NB, bits, shim_type);
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return modbus_read_input_bits(ctx, UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
+                                          bits, shim_type);
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                                         registers, shim_type);
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return modbus_read_input_registers(ctx, UT_INPUT_REGISTERS_ADDRESS,
+                                               UT_INPUT_REGISTERS_NB, registers, shim_type);
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+            return modbus_write_bit(ctx, UT_BITS_ADDRESS, ON, shim_type);
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            return modbus_write_register(ctx, UT_REGISTERS_ADDRESS, 0x1234, shim_type);
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            modbus_set_bits_from_bytes(bits, 0, UT_BITS_NB, UT_BITS_TAB);
+            return modbus_write_bits(ctx, UT_BITS_ADDRESS, UT_BITS_NB, bits, shim_type);
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return modbus_write_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                                          UT_REGISTERS_TAB, shim_type);
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+            return modbus_mask_write_register(ctx, UT_REGISTERS_ADDRESS, 0xF2, 0x25, shim_type);
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return modbus_write_and_read_registers(ctx, UT_REGISTERS_ADDRESS + 1,
+                                                   UT_REGISTERS_NB - 1, UT_REGISTERS_TAB,
+                                                   UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                                                   registers, shim_type);
+        default:
+            return -1;
+    }
+}
+
+/* The first address and number of items of a call issued by issue_call() */
+static void
+call_range(int function, uint16_t *addr, int *nb)
+{
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            *addr = UT_BITS_ADDRESS;
+            *nb = (function == MODBUS_FC_WRITE_SINGLE_COIL) ? 1 : UT_BITS_NB;
+            break;
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            *addr = UT_INPUT_BITS_ADDRESS;
+            *nb = UT_INPUT_BITS_NB;
+            break;
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            *addr = UT_INPUT_REGISTERS_ADDRESS;
+            *nb = UT_INPUT_REGISTERS_NB;
+            break;
+        default:
+            *addr = UT_REGISTERS_ADDRESS;
+            *nb = UT_REGISTERS_NB;
+    }
+}
+
+/**
+ * Open a MAC session on ctx covering every call in mix: its function
+ * codes, on the range spanning the addresses they use
+ * */
+static int
+open_session(modbus_t *ctx, const std::vector<int> &mix)
+{
+    uint16_t addr_min = UINT16_MAX;
+    uint16_t addr_max = 0;
+    uint16_t addr;
+    uint16_t last;
+    int nb;
+
+    for(int function : mix) {
+        call_range(function, &addr, &nb);
+        last = find_max_address(function, addr, nb);
+        addr_min = (addr < addr_min) ? addr : addr_min;
+        addr_max = (last > addr_max) ? last : addr_max;
+    }
+
+    return modbus_open_session_macaroons(ctx, mix, addr_min, addr_max);
+}
+
+/* Issue one call of the given function code through async, as issue_call() */
+static int
+issue_async_call(shim_async_t *async, int function, shim_async_callback_t callback, void *user)
+{
+    static uint8_t bits[UT_BITS_NB];
+    static uint16_t registers[UT_REGISTERS_NB_MAX];
+
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+            return shim_async_read_bits(async, UT_BITS_ADDRESS, UT_BITS_NB, bits,
+                                        callback, user);
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return shim_async_read_input_bits(async, UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
+                                              bits, callback, user);
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return shim_async_read_registers(async, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                                             registers, callback, user);
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return shim_async_read_input_registers(async, UT_INPUT_REGISTERS_ADDRESS,
+                                                   UT_INPUT_REGISTERS_NB, registers,
+                                                   callback, user);
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+            return shim_async_write_bit(async, UT_BITS_ADDRESS, ON, callback, user);
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            return shim_async_write_register(async, UT_REGISTERS_ADDRESS, 0x1234,
+                                             callback, user);
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            modbus_set_bits_from_bytes(bits, 0, UT_BITS_NB, UT_BITS_TAB);
+            return shim_async_write_bits(async, UT_BITS_ADDRESS, UT_BITS_NB, bits,
+                                         callback, user);
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return shim_async_write_registers(async, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                                              UT_REGISTERS_TAB, callback, user);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+/* Record the outcome of a pipelined call */
+static void
+record_call(client_t *client, size_t index, bench_clock::time_point start, int rc)
+{
+    if(rc == -1) {
+        client->errors[index]++;
+    } else {
+        client->latencies[index].push_back((uint32_t)
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                bench_clock::now() - start).count());
+    }
+}
+
+static void
+call_completed(void *user, int rc)
+{
+    pending_call_t *call = (pending_call_t *)user;
+
+    if(call->record) {
+        record_call(call->client, call->index, call->start, rc);
+    }
+}
+
+/**
+ * Run nb_calls calls through the asynchronous API, keeping client->depth
+ * in flight.  Responses arrive in order, so the context of call i can
+ * reuse that of call i - depth - 1.
+ * */
+static void
+client_run_pipelined(client_t *client, int nb_calls, bool record)
+{
+    shim_async_t async;
+    std::vector<pending_call_t> calls(client->depth + 1);
+    pending_call_t *call;
+
+    shim_async_init(&async, client->ctx, client->depth, client->shim_type);
+
+    for(int i = 0; i < nb_calls; i++) {
+        /* wait for room first, so the latency excludes time queued here */
+        while(async.nb_pending >= async.window) {
+            shim_async_poll(&async);
+        }
+
+        call = &calls[i % calls.size()];
+        call->client = client;
+        call->index = i % client->mix->size();
+        call->record = record;
+        call->start = bench_clock::now();
+
+        if(issue_async_call(&async, (*client->mix)[call->index],
+                            call_completed, call) == -1 && record) {
+            client->errors[call->index]++;
+        }
+    }
+
+    shim_async_flush(&async);
+}
+
+/* Run nb_calls calls, cycling through the mix; record latencies if asked to */
+static void
+client_run(client_t *client, int nb_calls, bool record)
+{
+    bench_clock::time_point start;
+    size_t index;
+    int rc;
+
+    count_allocations_ = false;
+
+    if(client->depth > 1) {
+        client_run_pipelined(client, nb_calls, record);
+        return;
+    }
+
+    for(int i = 0; i < nb_calls; i++) {
+        index = i % client->mix->size();
+
+        start = bench_clock::now();
+        rc = issue_call(client->ctx, (*client->mix)[index], client->shim_type);
+        if(!record) {
+            continue;
+        }
+
+        record_call(client, index, start, rc);
+    }
+}
+
+/* Latency (in us) below which the given fraction of samples fall */
+static double
+percentile(const latencies_t &sorted, double fraction)
+{
+    size_t index;
+
+    if(sorted.empty()) {
+        return 0.0;
+    }
+
+    index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+/* Print results for one mode, per distinct function code in the mix */
+static void
+report(shim_t shim_type, const std::vector<int> &mix,
+       const std::vector<client_t> &clients, double seconds,
+       uint64_t allocations, uint64_t rejects, bool csv)
+{
+    std::vector<int> functions(mix);
+    uint64_t total_calls = 0;
+
+    std::sort(functions.begin(), functions.end());
+    functions.erase(std::unique(functions.begin(), functions.end()), functions.end());
+
+    for(int function : functions) {
+        latencies_t merged;
+        int errors = 0;
+
+        for(const client_t &client : clients) {
+            for(size_t i = 0; i < mix.size(); i++) {
+                if(mix[i] == function) {
+                    merged.insert(merged.end(), client.latencies[i].begin(),
+                                  client.latencies[i].end());
+                    errors += client.errors[i];
+                }
+            }
+        }
+        std::sort(merged.begin(), merged.end());
+        total_calls += merged.size() + errors;
+
+        if(csv) {
+            printf("%s,%s,%.0f,%.1f,%.1f,%.1f,%d\n",
+                   get_shim_name(shim_type), get_modbus_function_name(function),
+                   merged.size() / seconds, percentile(merged, 0.50),
+                   percentile(merged, 0.99), percentile(merged, 0.999), errors);
+        } else {
+            printf("%-16s %-36s %12.0f %10.1f %10.1f %10.1f %8d\n",
+                   get_shim_name(shim_type), get_modbus_function_name(function),
+                   merged.size() / seconds, percentile(merged, 0.50),
+                   percentile(merged, 0.99), percentile(merged, 0.999), errors);
+        }
+    }
+
+    if(!csv) {
+        printf("%-16s %-36s %12.0f %32s %.2f allocs/call, %llu refused (server)\n\n",
+               get_shim_name(shim_type), "TOTAL", total_calls / seconds, "",
+               total_calls ? (double)allocations / total_calls : 0.0,
+               (unsigned long long)rejects);
+    }
+}
+
+/* Requests refused by the shims so far, for every reason */
+static uint64_t
+count_rejects(void)
+{
+    uint64_t rejects = 0;
+
+    for(int i = 0; i < SHIM_REJECT_COUNT; i++) {
+        rejects += get_shim_reject_count((shim_reject_t)i);
+    }
+
+    return rejects;
+}
+
+/**
+ * Benchmark a single shim mode: start a server, connect the clients,
+ * warm up, then time nb_calls calls from every client concurrently.
+ * */
+static int
+benchmark_shim(shim_t shim_type, int port, int nb_clients, int nb_workers, int nb_calls,
+               int depth, bool mac_session, int nb_handles,
+               const std::vector<int> &mix, bool csv)
+{
+    modbus_t *server_ctx;
+    modbus_mapping_t *mb_mapping;
+    server_config_t config;
+    std::atomic<bool> stop(false);
+    std::vector<client_t> clients(nb_clients);
+    std::vector<std::thread> threads;
+    bench_clock::time_point start;
+    double seconds;
+    uint64_t allocations;
+    uint64_t rejects;
+    int s;
+    int rc = 0;
+
+    mb_mapping = modbus_mapping_new_start_address(
+        UT_BITS_ADDRESS, UT_BITS_NB,
+        UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
+        UT_REGISTERS_ADDRESS, UT_REGISTERS_NB_MAX,
+        UT_INPUT_REGISTERS_ADDRESS, UT_INPUT_REGISTERS_NB,
+        shim_type);
+    if(mb_mapping == NULL) {
+        fprintf(stderr, "Failed to allocate the mapping: %s\n", modbus_strerror(errno));
+        return -1;
+    }
+
+    if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
+        if(initialise_server_macaroon("https://www.modbus.com/macaroons/",
+                                      "a bad secret", "id for a bad secret") == -1 ||
+           (nb_handles > 0 && token_handle_table_init(nb_handles, TOKEN_HANDLE_CLOCK) == -1)) {
+            modbus_mapping_free(mb_mapping);
+            return -1;
+        }
+    }
+
+    server_ctx = modbus_new_tcp("127.0.0.1", port);
+    s = modbus_tcp_listen(server_ctx, SERVER_LISTEN_BACKLOG);
+    if(s == -1) {
+        fprintf(stderr, "Failed to listen: %s\n", modbus_strerror(errno));
+        modbus_free(server_ctx);
+        modbus_mapping_free(mb_mapping);
+        return -1;
+    }
+
+    config.max_connections = nb_clients;
+    config.nb_workers = nb_workers;
+    config.debug = SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_TRACE);
+    config.stop = &stop;
+    std::thread server([&]() {
+        modbus_server_loop(s, mb_mapping, shim_type, &config);
+    });
+
+    for(client_t &client : clients) {
+        client.ctx = modbus_new_tcp("127.0.0.1", port);
+        client.shim_type = shim_type;
+        client.depth = depth;
+        client.mix = &mix;
+        client.latencies.assign(mix.size(), latencies_t());
+        client.errors.assign(mix.size(), 0);
+        for(latencies_t &latencies : client.latencies) {
+            latencies.reserve(nb_calls / mix.size() + 1);
+        }
+
+        if(modbus_connect(client.ctx) == -1) {
+            fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
+            rc = -1;
+        }
+    }
+
+    /* the Macaroon is fetched once and shared by every client */
+    if(rc == 0 && (shim_type == MACAROONS || shim_type == CHERI_MACAROONS)) {
+        rc = initialise_client_macaroon(clients[0].ctx) == -1 ? -1 : 0;
+    }
+
+    if(rc == 0 && nb_handles > 0 && (shim_type == MACAROONS || shim_type == CHERI_MACAROONS)) {
+        for(client_t &client : clients) {
+            modbus_set_token_handles_macaroons(client.ctx, true);
+        }
+    }
+
+    if(rc == 0 && mac_session && (shim_type == MACAROONS || shim_type == CHERI_MACAROONS)) {
+        for(client_t &client : clients) {
+            if(open_session(client.ctx, mix) == -1) {
+                fprintf(stderr, "Failed to open a MAC session: %s\n", modbus_strerror(errno));
+                rc = -1;
+                break;
+            }
+        }
+    }
+
+    if(rc == 0) {
+        for(client_t &client : clients) {
+            threads.emplace_back(client_run, &client, BENCH_WARMUP_CALLS, false);
+        }
+        for(std::thread &thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+
+        server_allocations_.store(0);
+        rejects = count_rejects();
+        start = bench_clock::now();
+        for(client_t &client : clients) {
+            threads.emplace_back(client_run, &client, nb_calls, true);
+        }
+        for(std::thread &thread : threads) {
+            thread.join();
+        }
+        seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        allocations = server_allocations_.load();
+        rejects = count_rejects() - rejects;
+
+        report(shim_type, mix, clients, seconds, allocations, rejects, csv);
+    }
+
+    for(client_t &client : clients) {
+        modbus_close_session_macaroons(client.ctx);
+        modbus_set_token_handles_macaroons(client.ctx, false);
+        modbus_close(client.ctx);
+        modbus_free(client.ctx);
+    }
+
+    stop.store(true);
+    server.join();
+
+    close(s);
+    modbus_free(server_ctx);
+    modbus_mapping_free(mb_mapping);
+
+    return rc;
+}
+
+static void
+usage(void)
+{
+    std::cout << "usage: cheri_macaroons_benchmark [-c clients] [-w workers] [-n calls] [-d depth] [-s] [-H] [-h handles] "
+                 "[-p port] [-f fc,fc,...] [-C] [NONE|CHERI|MACAROONS|CHERI_MACAROONS ...]" << std::endl;
+    std::cout << "  -c  client threads (default " << BENCH_DEFAULT_CLIENTS << ")" << std::endl;
+    std::cout << "  -w  server worker threads, 0 for none (default " << BENCH_DEFAULT_WORKERS << ")" << std::endl;
+    std::cout << "  -n  calls per client per mode (default " << BENCH_DEFAULT_CALLS << ")" << std::endl;
+    std::cout << "  -d  calls in flight per client, above 1 pipelines through the async API "
+                 "(default " << BENCH_DEFAULT_DEPTH << ", max " << SHIM_ASYNC_MAX_WINDOW << ")" << std::endl;
+    std::cout << "  -s  Macaroons clients send requests in a MAC session, not with tokens" << std::endl;
+    std::cout << "  -H  Macaroons clients send requests with token handles, not tokens" << std::endl;
+    std::cout << "  -h  server token handle table capacity, implies -H (default "
+              << TOKEN_HANDLE_DEFAULT_CAPACITY << ")" << std::endl;
+    std::cout << "  -p  loopback port (default " << BENCH_DEFAULT_PORT << ")" << std::endl;
+    std::cout << "  -f  function code mix, repeated codes are weighted (default all)" << std::endl;
+    std::cout << "  -C  CSV output, for comparing builds" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int nb_clients = BENCH_DEFAULT_CLIENTS;
+    int nb_workers = BENCH_DEFAULT_WORKERS;
+    int nb_calls = BENCH_DEFAULT_CALLS;
+    int depth = BENCH_DEFAULT_DEPTH;
+    int port = BENCH_DEFAULT_PORT;
+    bool mac_session = false;
+    int nb_handles = 0;
+    bool csv = false;
+    std::vector<int> mix;
+    std::vector<shim_t> shims;
+    shim_t shim_type;
+    int opt;
+
+    count_allocations_ = false;
+
+    /* everything cheri_macaroons_client exercises, except mask write */
+    parse_mix("0x01,0x02,0x03,0x04,0x05,0x06,0x0F,0x10,0x17", &mix);
+
+    while((opt = getopt(argc, argv, "c:w:n:d:sHh:p:f:C")) != -1) {
+        switch(opt) {
+            case 'c':
+                nb_clients = atoi(optarg);
+                break;
+            case 'w':
+                nb_workers = atoi(optarg);
+                break;
+            case 'n':
+                nb_calls = atoi(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 's':
+                mac_session = true;
+                break;
+            case 'H':
+                if(nb_handles == 0) {
+                    nb_handles = TOKEN_HANDLE_DEFAULT_CAPACITY;
+                }
+                break;
+            case 'h':
+                nb_handles = atoi(optarg);
+                if(nb_handles < 1) {
+                    usage();
+                    return -1;
+                }
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'f':
+                if(!parse_mix(optarg, &mix)) {
+                    usage();
+                    return -1;
+                }
+                break;
+            case 'C':
+                csv = true;
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+
+    for(int i = optind; i < argc; i++) {
+        if(!parse_shim(argv[i], &shim_type)) {
+            usage();
+            return -1;
+        }
+        shims.push_back(shim_type);
+    }
+    if(shims.empty()) {
+        shims = {NONE, CHERI, MACAROONS, CHERI_MACAROONS};
+    }
+
+    if(nb_clients < 1 || nb_workers < 0 || nb_calls < 1 ||
+       depth < 1 || depth > SHIM_ASYNC_MAX_WINDOW) {
+        usage();
+        return -1;
+    }
+
+    /* mask write and write-and-read have no asynchronous form */
+    if(depth > 1) {
+        mix.erase(std::remove_if(mix.begin(), mix.end(),
+                                 [](int function) { return !is_async_function(function); }),
+                  mix.end());
+        if(mix.empty()) {
+            usage();
+            return -1;
+        }
+    }
+
+    if(SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_INFO)) {
+        fprintf(stderr, "warning: built with logging enabled, results include logging cost\n");
+    }
+
+    if(csv) {
+        printf("shim,function,calls_per_sec,p50_us,p99_us,p999_us,errors\n");
+    } else {
+        printf("%-16s %-36s %12s %10s %10s %10s %8s\n", "shim", "function",
+               "calls/sec", "p50 (us)", "p99 (us)", "p999 (us)", "errors");
+    }
+
+    for(shim_t s : shims) {
+        if(benchmark_shim(s, port, nb_clients, nb_workers, nb_calls, depth, mac_session,
+                          nb_handles, mix, csv) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -115,7 +115,7 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Unable to allocate libmodbus context\n");
         return -1;
     }
-    modbus_set_debug(ctx, TRUE);
+    modbus_set_debug(ctx, SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_TRACE));
     modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_LINK_AND_PROTOCOL);
 
     modbus_get_response_timeout(ctx, &old_response_to_sec, &old_response_to_usec);
@@ -329,6 +329,36 @@ int main(int argc, char *argv[])
 
     // /* End of many registers */
 
+    /** MAC SESSION **/
+    if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
+        printf("\nTEST MAC SESSION:\n");
+
+        rc = modbus_open_session_macaroons(ctx, {MODBUS_FC_READ_HOLDING_REGISTERS},
+                                           UT_REGISTERS_ADDRESS,
+                                           find_max_address(MODBUS_FC_READ_HOLDING_REGISTERS,
+                                                            UT_REGISTERS_ADDRESS,
+                                                            UT_REGISTERS_NB));
+        printf("1/3 modbus_open_session_macaroons: ");
+        ASSERT_TRUE(rc == 0 && modbus_session_is_open_macaroons(ctx), "FAILED (%s)\n",
+                    modbus_strerror(errno));
+
+        memset(tab_rp_registers, 0xFF, UT_REGISTERS_NB * sizeof(uint16_t));
+        rc = modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                                   tab_rp_registers,
+                                   shim_type);
+        printf("2/3 modbus_read_registers in the session: ");
+        ASSERT_TRUE(rc == UT_REGISTERS_NB && tab_rp_registers[0] == UT_REGISTERS_TAB[0] &&
+                    tab_rp_registers[1] == 0, "FAILED (nb points %d)\n", rc);
+
+        /* the session's Macaroon only authorises reading those registers */
+        rc = modbus_write_register(ctx, UT_REGISTERS_ADDRESS, 0x12,
+                                   shim_type);
+        printf("3/3 modbus_write_register in the session: ");
+        ASSERT_TRUE(rc == -1 && errno == EMBXNOTAUTH, "FAILED (rc %d)\n", rc);
+
+        modbus_close_session_macaroons(ctx);
+    }
+
 
     /** INPUT REGISTERS **/
     rc = modbus_read_input_registers(ctx, UT_INPUT_REGISTERS_ADDRESS,
@@ -828,10 +858,11 @@ int test_server(modbus_t *ctx, int use_backend)
         /* Dummy data to write */
         0x02, 0x2B, 0x00, 0x01, 0x00, 0x64
     };
-    const int INVALID_FC = 0x42;
+    /* unassigned: the shims reserve 0x41-0x47 (see tcp_frame.hpp) */
+    const int INVALID_FC = 0x48;
     const int INVALID_FC_REQ_LEN = 6;
     uint8_t invalid_fc_raw_req[] = {
-        slave, 0x42, 0x00, 0x00, 0x00, 0x00
+        slave, INVALID_FC, 0x00, 0x00, 0x00, 0x00
     };
 
     int req_length;
@@ -28,6 +28,16 @@ extern "C" {
 /* CHERI Macaroons */
 #include "cheri_macaroons_shim.hpp"
 #include "macaroons_shim.hpp"
+#include "server_loop.hpp"
+
+/* Maximum number of simultaneous client connections */
+#define SERVER_MAX_CONNECTIONS 1024
+
+/* Worker threads running the shims; 0 runs them on the network thread */
+#define SERVER_NB_WORKERS 4
+
+/* Verified tokens kept for clients by handle; beyond this, the least recently used go (CLOCK) */
+#define SERVER_TOKEN_HANDLES 16384
 
 enum {
     TCP,
@@ -42,13 +52,9 @@ int main(int argc, char *argv[])
     modbus_mapping_t *mb_mapping;
     int rc;
     int i;
-    uint8_t *query = NULL;
-    uint8_t *rsp = NULL;
-    int rsp_length = 0;
-    int header_length;
+    server_config_t config;
 
     shim_t shim_type;
-    shim_s shim_state;
 
     /* identify the shim type.  default = CHERI_MACAROONS. */
     if (argc > 1) {
@@ -69,12 +75,8 @@ int main(int argc, char *argv[])
     }
 
     ctx = modbus_new_tcp("127.0.0.1", 1502);
-    query = (uint8_t *)malloc(MODBUS_MAX_STRING_LENGTH * sizeof(uint8_t));
-    rsp = (uint8_t *)malloc(MODBUS_TCP_MAX_ADU_LENGTH * sizeof(uint8_t));
-
-    header_length = modbus_get_header_length(ctx);
 
-    modbus_set_debug(ctx, TRUE);
+    modbus_set_debug(ctx, SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_TRACE));
 
     mb_mapping = modbus_mapping_new_start_address(
         UT_BITS_ADDRESS, UT_BITS_NB,
@@ -108,47 +110,50 @@ int main(int argc, char *argv[])
         std::string location = "https://www.modbus.com/macaroons/";
         rc = initialise_server_macaroon(location, key, id);
         if(rc == -1) {
+            fprintf(stderr, "Failed to initialise the server Macaroon: %s\n", modbus_strerror(errno));
+            modbus_mapping_free(mb_mapping);
+            modbus_free(ctx);
             return -1;
         }
-    }
-
-    s = modbus_tcp_listen(ctx, 1);
-    modbus_tcp_accept(ctx, &s);
-
-    for (;;) {
-        do {
-            rc = modbus_receive(ctx, query);
-            /* Filtered queries return 0 */
-        } while (rc == 0);
-
-        /* The connection is not closed on errors which require on reply such as
-           bad CRC in RTU. */
-        if (rc == -1 && errno != EMBBADCRC) {
-            /* Quit */
-            break;
-        }
 
-        shim_state = INIT;
-        rc = modbus_process_request(ctx, query, rc, rsp, &rsp_length, mb_mapping,
-                                    shim_type, shim_state);
-        if (rc == -1) {
-            break;
+        rc = token_handle_table_init(SERVER_TOKEN_HANDLES, TOKEN_HANDLE_CLOCK);
+        if(rc == -1) {
+            fprintf(stderr, "Failed to allocate the token handle table: %s\n", modbus_strerror(errno));
+            modbus_mapping_free(mb_mapping);
+            modbus_free(ctx);
+            return -1;
         }
+    }
 
-        rc = modbus_reply(ctx, rsp, rsp_length);
-        if (rc == -1) {
-            break;
-        }
+    s = modbus_tcp_listen(ctx, SERVER_LISTEN_BACKLOG);
+    if (s == -1) {
+        fprintf(stderr, "Failed to listen: %s\n", modbus_strerror(errno));
+        modbus_mapping_free(mb_mapping);
+        modbus_free(ctx);
+        return -1;
     }
 
+    /**
+     * Serve any number of clients (e.g., SCADA masters, historians, HMIs)
+     * concurrently.  A request the shims refuse is answered with an
+     * exception, and a client disconnecting or sending a malformed frame
+     * only closes its own connection.
+     * */
+    config.max_connections = SERVER_MAX_CONNECTIONS;
+    config.nb_workers = SERVER_NB_WORKERS;
+    config.debug = SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_TRACE);
+    config.stop = NULL;
+    rc = modbus_server_loop(s, mb_mapping, shim_type, &config);
+
     printf("Quit the loop: %s\n", modbus_strerror(errno));
+    log_shim_reject_counts();
 
     if (s != -1) {
         close(s);
     }
 
     modbus_mapping_free(mb_mapping);
-    free(query);
+    modbus_free(ctx);
 
-    return 0;
+    return (rc == -1) ? -1 : 0;
 }
@@ -1,18 +1,29 @@
 #include "cheri_macaroons_shim.hpp"
 #include "macaroons_shim.hpp"
 #include "cheri_shim.hpp"
+#include "shim_pipeline.hpp"
+
+/* Requests refused by the shims, indexed by shim_reject_t */
+static std::atomic<uint64_t> reject_counts_[SHIM_REJECT_COUNT];
+
+/* Identifies each session (connection) for the token handles it owns */
+static std::atomic<uint64_t> next_session_id_(1);
 
 /******************
  * HELPER FUNCTIONS
  *****************/
 
 void
-print_shim_info(std::string file, std::string function)
+shim_session_init(shim_session_t *session, mapping_seqlock_t *seqlock)
 {
-    int length = file.length() + function.length() + 3;
-    std::cout << display_marker << std::endl;
-    std::cout << file << ":" << function << "()" << std::endl;
-    std::cout << std::string(length, '-') << std::endl;
+    session->id = next_session_id_.fetch_add(1, std::memory_order_relaxed);
+    session->token_valid = false;
+    session->token_signed = false;
+    compiled_caveats_init(&session->token_caveats);
+    session->token_chunks.clear();
+    session->mac_session = false;
+    session->session_sequence = 0;
+    session->seqlock = seqlock;
 }
 
 /**
@@ -21,15 +32,10 @@ print_shim_info(std::string file, std::string function)
 void
 print_modbus_function_name(int function)
 {
-    std::cout << std::showbase // show the 0x prefix
-            << std::internal // fill between the prefix and the number
-            << std::setfill('0') // fill with 0s
-            << std::hex;
-    std::cout << ">\tfunction: " << function << " (" <<
-        get_modbus_function_name(function) << ")" << std::endl;
+    SHIM_LOG_TRACE(">\tfunction: %#x (%s)", function, get_modbus_function_name(function));
 }
 
-std::string
+const char *
 get_modbus_function_name(int function)
 {
     switch(function) {
@@ -70,35 +76,73 @@ get_modbus_function_name(int function)
 void
 print_mb_mapping(modbus_mapping_t* mb_mapping)
 {
-    printf("mb_mapping:\t\t%#p\n", (void *)mb_mapping);
-    printf("->tab_bits:\t\t%#p\n", (void *)mb_mapping->tab_bits);
-    printf("->tab_input_bits:\t%#p\n", (void *)mb_mapping->tab_input_bits);
-    printf("->tab_input_registers:\t%#p\n", (void *)mb_mapping->tab_input_registers);
-    printf("->tab_registers:\t%#p\n", (void *)mb_mapping->tab_registers);
-    printf("->tab_string:\t\t%#p\n", (void *)mb_mapping->tab_string);
+    SHIM_LOG_TRACE("mb_mapping:\t\t%#p\n"
+                   "->tab_bits:\t\t%#p\n"
+                   "->tab_input_bits:\t%#p\n"
+                   "->tab_input_registers:\t%#p\n"
+                   "->tab_registers:\t%#p\n"
+                   "->tab_string:\t\t%#p",
+                   (void *)mb_mapping,
+                   (void *)mb_mapping->tab_bits,
+                   (void *)mb_mapping->tab_input_bits,
+                   (void *)mb_mapping->tab_input_registers,
+                   (void *)mb_mapping->tab_registers,
+                   (void *)mb_mapping->tab_string);
 }
 
 /* Helper function to print the elements of a request. */
 void
-print_modbus_decompose_request(modbus_t *ctx, const uint8_t *req, int *offset,
-                               int *slave_id, int *function, uint16_t *addr, int *nb,
-                               uint16_t *addr_wr, int *nb_wr)
+print_modbus_decompose_request(const shim_request_t *request)
 {
-    modbus_decompose_request(ctx, req, offset, slave_id, function, addr, nb, addr_wr, nb_wr);
-
-    std::cout << std::showbase // show the 0x prefix
-              << std::internal // fill between the prefix and the number
-              << std::setfill('0') // fill with 0s
-              << std::hex;
-    std::cout << "decompose request:" << std::endl;
-    std::cout << "> " << "offset:\t\t" << *offset << std::endl;
-    std::cout << "> " << "slave_id:\t\t" << *slave_id << std::endl;
-    std::cout << "> " << "function:\t\t" << *function << " (" <<
-        get_modbus_function_name(*function) << ")" << std::endl;
-    std::cout << "> " << "addr:\t\t\t" << *addr << std::endl;
-    std::cout << "> " << "nb:\t\t\t" << *nb << std::endl;
-    std::cout << "> " << "addr_wr:\t\t" << *addr_wr << std::endl;
-    std::cout << "> " << "nb_wr:\t\t" << *nb_wr << std::endl;
+    SHIM_LOG_TRACE("decompose request:\n"
+                   "> offset:\t\t%#x\n"
+                   "> slave_id:\t\t%#x\n"
+                   "> function:\t\t%#x (%s)\n"
+                   "> addr:\t\t\t%#x\n"
+                   "> nb:\t\t\t%#x\n"
+                   "> addr_wr:\t\t%#x\n"
+                   "> nb_wr:\t\t%#x",
+                   request->offset, request->slave_id,
+                   request->function, get_modbus_function_name(request->function),
+                   request->addr, request->nb, request->addr_wr, request->nb_wr);
+}
+
+const char *
+get_shim_reject_name(shim_reject_t reason)
+{
+    switch(reason) {
+        case SHIM_REJECT_MALFORMED:
+            return "malformed authenticated request";
+        case SHIM_REJECT_TOKEN:
+            return "no verified Macaroon";
+        case SHIM_REJECT_FUNCTION:
+            return "function not in caveats";
+        case SHIM_REJECT_ADDRESS:
+            return "addresses not in caveats";
+        case SHIM_REJECT_CAPABILITY:
+            return "capability check failed";
+        case SHIM_REJECT_SESSION:
+            return "session MAC check failed";
+        case SHIM_REJECT_HANDLE:
+            return "token handle unknown or evicted";
+        default:
+            return "unknown";
+    }
+}
+
+uint64_t
+get_shim_reject_count(shim_reject_t reason)
+{
+    return reject_counts_[reason].load(std::memory_order_relaxed);
+}
+
+void
+log_shim_reject_counts(void)
+{
+    for(int i = 0; i < SHIM_REJECT_COUNT; i++) {
+        SHIM_LOG_INFO("rejected (%s): %llu", get_shim_reject_name((shim_reject_t)i),
+                      (unsigned long long)get_shim_reject_count((shim_reject_t)i));
+    }
 }
 
 /******************
@@ -109,7 +153,7 @@ print_modbus_decompose_request(modbus_t *ctx, const uint8_t *req, int *offset,
    in the destination to TRUE or FALSE (single bits). */
 int modbus_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_read_bits_macaroons(ctx, addr, nb, dest);
@@ -121,7 +165,7 @@ int modbus_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest, shim_t shim
 /* Same as modbus_read_bits but reads the remote device input table */
 int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_read_input_bits_macaroons(ctx, addr, nb, dest);
@@ -134,7 +178,7 @@ int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest, shim_
    array */
 int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_read_registers_macaroons(ctx, addr, nb, dest);
@@ -147,7 +191,7 @@ int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest, shim_
 int modbus_read_input_registers(modbus_t *ctx, int addr, int nb,
                                 uint16_t *dest, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_read_input_registers_macaroons(ctx, addr, nb, dest);
@@ -159,7 +203,7 @@ int modbus_read_input_registers(modbus_t *ctx, int addr, int nb,
 /* Turns ON or OFF a single bit of the remote device */
 int modbus_write_bit(modbus_t *ctx, int addr, int status, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_write_bit_macaroons(ctx, addr, status);
@@ -172,7 +216,7 @@ int modbus_write_bit(modbus_t *ctx, int addr, int status, shim_t shim_type)
 int modbus_write_register(modbus_t *ctx, int addr,
                           const uint16_t value, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_write_register_macaroons(ctx, addr, value);
@@ -185,7 +229,7 @@ int modbus_write_register(modbus_t *ctx, int addr,
 int modbus_write_bits(modbus_t *ctx, int addr, int nb,
                       const uint8_t *src, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_write_bits_macaroons(ctx, addr, nb, src);
@@ -198,7 +242,7 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb,
 int modbus_write_registers(modbus_t *ctx, int addr, int nb,
                            const uint16_t *src, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_write_registers_macaroons(ctx, addr, nb, src);
@@ -212,7 +256,7 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb,
 int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask,
                                uint16_t or_mask, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_mask_write_register_macaroons(ctx, addr,
@@ -231,7 +275,7 @@ int modbus_write_and_read_registers(modbus_t *ctx,
                                     int read_addr, int read_nb,
                                     uint16_t *dest, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_write_and_read_registers_macaroons(ctx, write_addr, write_nb, src,
@@ -246,7 +290,7 @@ int modbus_write_and_read_registers(modbus_t *ctx,
    communication). */
 int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest, shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_report_slave_id_macaroons(ctx, max_dest, dest);
@@ -274,9 +318,9 @@ modbus_mapping_t* modbus_mapping_new_start_address(
     unsigned int start_input_registers, unsigned int nb_input_registers,
     shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
-    /* If CHERI_X, then call the cheri_shim to restrict mb_mapping */
+    /* For the CHERI shims, cheri_shim builds mb_mapping and its restricted views */
     if(shim_type == CHERI || shim_type == CHERI_MACAROONS) {
         return modbus_mapping_new_start_address_cheri(
             start_bits, nb_bits,
@@ -294,13 +338,41 @@ modbus_mapping_t* modbus_mapping_new_start_address(
     }
 }
 
+/**
+ * Refuse a request: map reason to a Modbus exception code (illegal data
+ * value for a malformed request, handle evicted for an unknown token
+ * handle, not authorised otherwise), count the rejection, and build the
+ * exception response for function into rsp.
+ * */
+int shim_reply_exception(modbus_t *ctx, const uint8_t *req,
+                         uint8_t *rsp, int *rsp_length,
+                         int function, shim_reject_t reason)
+{
+    int exception_code = MODBUS_EXCEPTION_NOT_AUTHORISED;
+
+    if(reason == SHIM_REJECT_MALFORMED) {
+        exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    } else if(reason == SHIM_REJECT_HANDLE) {
+        exception_code = MODBUS_EXCEPTION_HANDLE_EVICTED;
+    }
+
+    reject_counts_[reason].fetch_add(1, std::memory_order_relaxed);
+    SHIM_LOG_DEBUG("> refused %s: %s", get_modbus_function_name(function),
+                   get_shim_reject_name(reason));
+
+    *rsp_length = tcp_frame_build_exception(req, modbus_get_header_length(ctx),
+                                            function, exception_code, rsp);
+
+    return *rsp_length;
+}
+
 /**
  * Receive the request from a modbus master
  * TODO:  ATM, this appears to be unnecessary.  Delete?
  * */
 int modbus_receive(modbus_t *ctx, uint8_t *req, shim_t shim_type)
 {
-    print_shim_info("macaroons_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
 
     if(shim_type == MACAROONS || shim_type == CHERI_MACAROONS) {
         return modbus_receive_macaroons(ctx, req);
@@ -312,59 +384,83 @@ int modbus_receive(modbus_t *ctx, uint8_t *req, shim_t shim_type)
 /**
  * Analyses the request and constructs a response.
  *
- * This is the most important function in the shim, and the ordering is important
+ * The request passes through the shim pipeline for shim_type (see
+ * shim_pipeline.hpp):
  *
- * If shim_type == NONE, then this simply calls libmodbus:modbus_process_request
- *
- * If shim_type == CHERI, this will call the function in cheri_shim, which
- * restricts permissions on mb_mapping, then calls this function again.  This
- * function will call libmodbus:modbus_process_request and then
- * return to cheri_shim to restore permissions on mb_mapping (and then return here...)
- *
- * If shim_type == MACAROONS, this will call the function in macaroon_shim, which
- * 1. For WRITE_STRING:  Reset tab_string and call this function again with state MODBUS_X
- * 2. For all other functions:  Verify the Macaroon (in tab_string) and
- *    call this function again with state MODBUS_X
- *
- * If shim_type == CHERI_MACAROON_SHIM, this will:
- * 1. call the function in macaroons_shim to either reset tab_string or
- *    verify the Macaroon (state -> MACAROON_X)
- * 2. call the function in cheri_shim to restrict permissions on mb_mapping (state -> CHERI_X)
- * 3. call libmodbus:modbus_process_request
+ * NONE:             libmodbus:modbus_process_request
+ * CHERI:            restrict mb_mapping to the function (cheri_shim), then libmodbus
+ * MACAROONS:        unwrap the request and check it against the Macaroon
+ *                   (macaroons_shim), then libmodbus
+ * CHERI_MACAROONS:  macaroons_shim, then cheri_shim, then libmodbus
  *
  * TODO:  Modify macaroons_shim to read any restrictions in the Macaroon and modify
  * the request before eventually sending it to cheri_shim
+ * */
+int modbus_process_request(modbus_t *ctx, uint8_t *req,
+                           int req_length, uint8_t *rsp, int *rsp_length,
+                           modbus_mapping_t *mb_mapping,
+                           shim_t shim_type)
+{
+    /* callers without connections of their own share one session */
+    static shim_session_t default_session;
+    static std::once_flag default_session_init;
+
+    std::call_once(default_session_init, shim_session_init, &default_session,
+                   (mapping_seqlock_t *)NULL);
+
+    return modbus_process_request(ctx, req, req_length, rsp, rsp_length,
+        mb_mapping, &default_session, shim_type);
+}
+
+/**
+ * Analyses a request that arrived on the connection owning session.
  *
- * TODO:  Modify cheri_shim to restrict mb_mapping based on the function, address, and nb in the request
+ * If session->seqlock is set, libmodbus accesses mb_mapping through it,
+ * so any number of sessions can process requests concurrently.
  * */
 int modbus_process_request(modbus_t *ctx, uint8_t *req,
                            int req_length, uint8_t *rsp, int *rsp_length,
                            modbus_mapping_t *mb_mapping,
-                           shim_t shim_type, shim_s shim_state)
+                           shim_session_t *session,
+                           shim_t shim_type)
 {
-    print_shim_info("cheri_macaroons_shim", std::string(__FUNCTION__));
-
-    if(shim_type == CHERI && shim_state == INIT) {
-        return modbus_process_request_cheri(ctx, req, req_length,
-            rsp, rsp_length, mb_mapping, shim_type, shim_state);
-    } else if(shim_type == MACAROONS && shim_state == INIT) {
-        return modbus_process_request_macaroons(ctx, req, req_length,
-            rsp, rsp_length, mb_mapping, shim_type, shim_state);
-    } else if(shim_type == CHERI_MACAROONS && shim_state == INIT) {
-        return modbus_process_request_macaroons(ctx, req, req_length,
-            rsp, rsp_length, mb_mapping, shim_type, shim_state);
-    } else if(shim_type == CHERI_MACAROONS && shim_state == MACAROONS_X) {
-        return modbus_process_request_cheri(ctx, req, req_length,
-            rsp, rsp_length, mb_mapping, shim_type, shim_state);
-    } else if( (shim_type == CHERI && shim_state == CHERI_X) ||
-               (shim_type == MACAROONS && shim_state == MACAROONS_X) ||
-               (shim_type == CHERI_MACAROONS && shim_state == CHERI_X) ||
-               (shim_type == NONE) ) {
-        std::cout << "> " << "calling modbus_process_request()" << std::endl;
-        std::cout << display_marker << std::endl;
-        return modbus_process_request(ctx, req, req_length,
-            rsp, rsp_length, mb_mapping);
-    } else {
-        return -1;
+    SHIM_LOG_ENTER("cheri_macaroons_shim");
+
+    switch(shim_type) {
+        case NONE:
+            return shim_none_pipeline_t::process(ctx, req, req_length,
+                rsp, rsp_length, mb_mapping, session);
+        case CHERI:
+            return shim_cheri_pipeline_t::process(ctx, req, req_length,
+                rsp, rsp_length, mb_mapping, session);
+        case MACAROONS:
+            return shim_macaroons_pipeline_t::process(ctx, req, req_length,
+                rsp, rsp_length, mb_mapping, session);
+        case CHERI_MACAROONS:
+            return shim_cheri_macaroons_pipeline_t::process(ctx, req, req_length,
+                rsp, rsp_length, mb_mapping, session);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+/**
+ * The last stage of every shim pipeline: call
+ * libmodbus:modbus_process_request(), through the session's seqlock if
+ * it has one
+ * */
+int shim_execute_request(modbus_t *ctx, uint8_t *req,
+                         int req_length, uint8_t *rsp, int *rsp_length,
+                         modbus_mapping_t *mb_mapping,
+                         shim_session_t *session)
+{
+    SHIM_LOG_TRACE("> calling modbus_process_request()\n%s", display_marker.c_str());
+
+    if(session != NULL && session->seqlock != NULL) {
+        return mapping_seqlock_process_request(session->seqlock, ctx, req, req_length,
+                                               rsp, rsp_length, mb_mapping);
     }
-}
\ No newline at end of file
+
+    return modbus_process_request(ctx, req, req_length, rsp, rsp_length, mb_mapping);
+}
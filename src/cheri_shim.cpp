@@ -1,9 +1,249 @@
 #include "cheri_shim.hpp"
 
+#include <stdlib.h>
+#include <errno.h>
+
 /******************
  * HELPER FUNCTIONS
  *****************/
 
+/**
+ * Permissions granted by each view
+ *
+ * Every view may read the serialised Macaroon (tab_string), except the
+ * string views, which grant exactly what the string functions need, and
+ * CHERI_VIEW_NONE, which grants nothing at all.
+ * */
+typedef struct {
+    size_t bits;
+    size_t input_bits;
+    size_t input_registers;
+    size_t registers;
+    size_t string;
+    size_t mapping;     /* the structure pointer itself */
+} cheri_view_perms_t;
+
+#define CHERI_STRUCT_PERMS (CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP)
+
+static const cheri_view_perms_t view_perms_[CHERI_VIEW_COUNT] = {
+    /* CHERI_VIEW_READ_COILS:  we only need to be able to read coil (tab_bits) values */
+    {CHERI_PERM_LOAD, 0, 0, 0, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_READ_DISCRETE_INPUTS:  we only need to be able to read discrete inputs */
+    {0, CHERI_PERM_LOAD, 0, 0, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_READ_HOLDING_REGISTERS:  we only need to be able to read holding registers */
+    {0, 0, 0, CHERI_PERM_LOAD, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_READ_INPUT_REGISTERS:  we only need to be able to read input registers */
+    {0, 0, CHERI_PERM_LOAD, 0, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_WRITE_COILS:  we only need to be able to store coil (tab_bits) values */
+    {CHERI_PERM_STORE, 0, 0, 0, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_WRITE_REGISTERS:  we only need to be able to write holding registers */
+    {0, 0, 0, CHERI_PERM_STORE, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_READ_WRITE_REGISTERS:  we need to read and write holding registers */
+    {0, 0, 0, CHERI_PERM_LOAD | CHERI_PERM_STORE, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_REPORT_SLAVE_ID:  we shouldn't need to read or write coils or registers */
+    {0, 0, 0, 0, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_WRITE_STRING:  we need to read and write the string used for Macaroons */
+    {0, 0, 0, 0, CHERI_PERM_LOAD | CHERI_PERM_STORE, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_READ_STRING:  we only need to read the string used for Macaroons */
+    {0, 0, 0, 0, CHERI_PERM_LOAD, CHERI_STRUCT_PERMS},
+    /* CHERI_VIEW_NONE:  the structure pointer shouldn't need to be referenced at all */
+    {0, 0, 0, 0, 0, 0},
+};
+
+/* Select the view for a function code */
+static cheri_view_t
+get_cheri_view(int function)
+{
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+            return CHERI_VIEW_READ_COILS;
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return CHERI_VIEW_READ_DISCRETE_INPUTS;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return CHERI_VIEW_READ_HOLDING_REGISTERS;
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return CHERI_VIEW_READ_INPUT_REGISTERS;
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            return CHERI_VIEW_WRITE_COILS;
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return CHERI_VIEW_WRITE_REGISTERS;
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return CHERI_VIEW_READ_WRITE_REGISTERS;
+        case MODBUS_FC_REPORT_SLAVE_ID:
+            return CHERI_VIEW_REPORT_SLAVE_ID;
+        case MODBUS_FC_WRITE_STRING:
+            return CHERI_VIEW_WRITE_STRING;
+        case MODBUS_FC_READ_STRING:
+            return CHERI_VIEW_READ_STRING;
+        default:
+            return CHERI_VIEW_NONE;
+    }
+}
+
+/**
+ * Derive every view from the (already restricted) mapping
+ *
+ * This is the only place the restricted capabilities are derived; the
+ * views are never written again, so any number of threads can use them.
+ * */
+static void
+build_cheri_views(cheri_mapping_t *cheri_mapping)
+{
+    const modbus_mapping_t *mapping = &cheri_mapping->mapping;
+
+    for(int i = 0; i < CHERI_VIEW_COUNT; i++) {
+        const cheri_view_perms_t *perms = &view_perms_[i];
+        modbus_mapping_t *view = &cheri_mapping->view_storage[i];
+
+        /* sizes and start addresses are shared with the mapping */
+        *view = *mapping;
+
+        view->tab_bits = (uint8_t *)cheri_perms_and(mapping->tab_bits, perms->bits);
+        view->tab_input_bits = (uint8_t *)cheri_perms_and(mapping->tab_input_bits, perms->input_bits);
+        view->tab_input_registers = (uint16_t *)cheri_perms_and(mapping->tab_input_registers, perms->input_registers);
+        view->tab_registers = (uint16_t *)cheri_perms_and(mapping->tab_registers, perms->registers);
+        view->tab_string = (uint8_t *)cheri_perms_and(mapping->tab_string, perms->string);
+
+        cheri_mapping->views[i] = (modbus_mapping_t *)cheri_perms_and(view, perms->mapping);
+
+        /* the same restrictions for the software backend; tables are unreachable without LOAD_CAP */
+        size_t reachable = (perms->mapping & CHERI_PERM_LOAD_CAP) ? ~(size_t)0 : 0;
+        cheri_soft_cap_t *caps = cheri_mapping->caps[i];
+
+        caps[CHERI_TABLE_BITS] = cheri_soft_cap_new(mapping->tab_bits,
+            mapping->nb_bits * sizeof(uint8_t), perms->bits & reachable);
+        caps[CHERI_TABLE_INPUT_BITS] = cheri_soft_cap_new(mapping->tab_input_bits,
+            mapping->nb_input_bits * sizeof(uint8_t), perms->input_bits & reachable);
+        caps[CHERI_TABLE_INPUT_REGISTERS] = cheri_soft_cap_new(mapping->tab_input_registers,
+            mapping->nb_input_registers * sizeof(uint16_t), perms->input_registers & reachable);
+        caps[CHERI_TABLE_REGISTERS] = cheri_soft_cap_new(mapping->tab_registers,
+            mapping->nb_registers * sizeof(uint16_t), perms->registers & reachable);
+        caps[CHERI_TABLE_STRING] = cheri_soft_cap_new(mapping->tab_string,
+            MODBUS_MAX_STRING_LENGTH * sizeof(uint8_t), perms->string & reachable);
+    }
+}
+
+#if CHERI_SOFT_CHECKS
+/**
+ * Check the access libmodbus makes to nb elements of table from addr,
+ * through view, against the view's software capability for the table.
+ *
+ * The access is computed from the view, as libmodbus computes it:
+ * libmodbus answers a range outside the view's table with
+ * MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS and never dereferences the table,
+ * so there is nothing to check.  Any other range is checked, bounds and
+ * permissions, against the capability (which spans the table as it was
+ * allocated).
+ * */
+static bool
+check_table_access(const cheri_mapping_t *cheri_mapping, cheri_view_t view,
+                   cheri_table_t table, int addr, int nb, size_t perms)
+{
+    const modbus_mapping_t *mapping = &cheri_mapping->view_storage[view];
+    const uint8_t *base;
+    int start;
+    int nb_table;
+    size_t size;
+
+    switch(table) {
+        case CHERI_TABLE_BITS:
+            base = mapping->tab_bits;
+            start = mapping->start_bits;
+            nb_table = mapping->nb_bits;
+            size = sizeof(uint8_t);
+            break;
+        case CHERI_TABLE_INPUT_BITS:
+            base = mapping->tab_input_bits;
+            start = mapping->start_input_bits;
+            nb_table = mapping->nb_input_bits;
+            size = sizeof(uint8_t);
+            break;
+        case CHERI_TABLE_INPUT_REGISTERS:
+            base = (const uint8_t *)mapping->tab_input_registers;
+            start = mapping->start_input_registers;
+            nb_table = mapping->nb_input_registers;
+            size = sizeof(uint16_t);
+            break;
+        case CHERI_TABLE_REGISTERS:
+            base = (const uint8_t *)mapping->tab_registers;
+            start = mapping->start_registers;
+            nb_table = mapping->nb_registers;
+            size = sizeof(uint16_t);
+            break;
+        default:
+            base = mapping->tab_string;
+            start = 0;
+            nb_table = MODBUS_MAX_STRING_LENGTH;
+            size = sizeof(uint8_t);
+    }
+
+    if(addr < start || nb < 1 || addr - start + nb > nb_table) {
+        return true;
+    }
+
+    return cheri_soft_cap_check(&cheri_mapping->caps[view][table],
+                                base + (size_t)(addr - start) * size, (size_t)nb * size, perms);
+}
+
+/**
+ * Check every table access a request implies against the view selected
+ * for it, as the hardware would when libmodbus makes the access
+ * */
+static bool
+check_cheri_view(const cheri_mapping_t *cheri_mapping, cheri_view_t view,
+                 const shim_request_t *request)
+{
+    switch(request->function) {
+        case MODBUS_FC_READ_COILS:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_BITS,
+                                      request->addr, request->nb, CHERI_PERM_LOAD);
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_INPUT_BITS,
+                                      request->addr, request->nb, CHERI_PERM_LOAD);
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_REGISTERS,
+                                      request->addr, request->nb, CHERI_PERM_LOAD);
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_INPUT_REGISTERS,
+                                      request->addr, request->nb, CHERI_PERM_LOAD);
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_BITS,
+                                      request->addr, 1, CHERI_PERM_STORE);
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_BITS,
+                                      request->addr, request->nb, CHERI_PERM_STORE);
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_REGISTERS,
+                                      request->addr, 1, CHERI_PERM_STORE);
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_REGISTERS,
+                                      request->addr, request->nb, CHERI_PERM_STORE);
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_REGISTERS,
+                                      request->addr, 1, CHERI_PERM_LOAD | CHERI_PERM_STORE);
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            /* addr/nb is the write range, addr_wr/nb_wr the read range */
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_REGISTERS,
+                                      request->addr, request->nb, CHERI_PERM_STORE) &&
+                   check_table_access(cheri_mapping, view, CHERI_TABLE_REGISTERS,
+                                      request->addr_wr, request->nb_wr, CHERI_PERM_LOAD);
+        case MODBUS_FC_WRITE_STRING:
+            /* libmodbus may write anywhere in the string */
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_STRING,
+                                      0, MODBUS_MAX_STRING_LENGTH, CHERI_PERM_STORE);
+        case MODBUS_FC_READ_STRING:
+            return check_table_access(cheri_mapping, view, CHERI_TABLE_STRING,
+                                      0, MODBUS_MAX_STRING_LENGTH, CHERI_PERM_LOAD);
+        default:
+            /* no table is accessed */
+            return true;
+    }
+}
+#endif /* CHERI_SOFT_CHECKS */
+
 /**
  * Shim function for libmodbus:modbus_mapping_new_start_address
  *
@@ -15,12 +255,10 @@
  * pointer to the structure itself can only load and store the data
  * and pointers within the structure
  *
- * TODO:  Consider copying everything returned from libmodbus to a new
- * pointer and returning that to the caller to libmodbus cannot retain
- * a fully-privileged pointer to the structure
- *
- * Alternately, we can just implement the allocation function from
- * libmodbus:modbus_mapping_new_start_address() here
+ * The structure is copied into a cheri_mapping_t, which also holds one
+ * view of the mapping per class of function code (see cheri_shim.hpp).
+ * The caller gets &cheri_mapping->mapping, so it is still freed with
+ * libmodbus:modbus_mapping_free().
  * */
 modbus_mapping_t* modbus_mapping_new_start_address_cheri(
     unsigned int start_bits, unsigned int nb_bits,
@@ -28,14 +266,33 @@ modbus_mapping_t* modbus_mapping_new_start_address_cheri(
     unsigned int start_registers, unsigned int nb_registers,
     unsigned int start_input_registers, unsigned int nb_input_registers)
 {
-    print_shim_info("cheri_shim", std::string(__FUNCTION__));
+    SHIM_LOG_ENTER("cheri_shim");
 
     modbus_mapping_t* mb_mapping;
-    mb_mapping = modbus_mapping_new_start_address(
+    modbus_mapping_t* allocated;
+    cheri_mapping_t* cheri_mapping;
+
+    allocated = modbus_mapping_new_start_address(
         start_bits, nb_bits,
         start_input_bits, nb_input_bits,
         start_registers, nb_registers,
         start_input_registers, nb_input_registers);
+    if(allocated == NULL) {
+        return NULL;
+    }
+
+    /* allocated with malloc(), so modbus_mapping_free() can release it */
+    cheri_mapping = (cheri_mapping_t *)malloc(sizeof(cheri_mapping_t));
+    if(cheri_mapping == NULL) {
+        modbus_mapping_free(allocated);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* the tables now belong to cheri_mapping; only the structure is released */
+    cheri_mapping->mapping = *allocated;
+    free(allocated);
+    mb_mapping = &cheri_mapping->mapping;
 
     // may need to be able to read and write to coils
     mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, CHERI_PERM_LOAD | CHERI_PERM_STORE);
@@ -54,236 +311,64 @@ modbus_mapping_t* modbus_mapping_new_start_address_cheri(
     // may need to read and write to the string (used for Macaroons)
     mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD | CHERI_PERM_STORE);
 
-    print_mb_mapping(mb_mapping);
+    build_cheri_views(cheri_mapping);
 
-    std::cout << display_marker << std::endl;
+    if(SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_TRACE)) {
+        print_mb_mapping(mb_mapping);
+        SHIM_LOG_TRACE("%s", display_marker.c_str());
+    }
 
     return mb_mapping;
 }
 
 /**
- * Shim function for libmodbus:modbus_process_request
+ * Restriction stage of the shim pipeline (see shim_pipeline.hpp)
  *
- * modbus_process_request processes a client request, modifies the server
- * state (if applicable) and sends a response to the client
+ * Returns the view of mb_mapping restricted for the function in the
+ * request, for libmodbus to process the request through, or NULL if the
+ * request was refused (rc is then the length of the exception response).
  * */
-int modbus_process_request_cheri(modbus_t *ctx, uint8_t *req,
-                                int req_length, uint8_t *rsp, int *rsp_length,
-                                modbus_mapping_t *mb_mapping,
-                                shim_t shim_type, shim_s shim_state)
+modbus_mapping_t *
+modbus_restrict_request_cheri(modbus_t *ctx, const uint8_t *req,
+                              uint8_t *rsp, int *rsp_length,
+                              modbus_mapping_t *mb_mapping,
+                              const shim_request_t *request, int *rc)
 {
-    int rc;
-    uint8_t *tab_bits_;
-    uint8_t *tab_input_bits_;
-    uint16_t *tab_input_registers_;
-    uint16_t *tab_registers_;
-    uint8_t *tab_string_;
-    modbus_mapping_t *mb_mapping_;
-
-    int *offset = (int *)malloc(sizeof(int));
-    int *slave_id = (int *)malloc(sizeof(int));
-    int *function = (int *)malloc(sizeof(int));
-    uint16_t *addr = (uint16_t *)malloc(sizeof(uint16_t));
-    int *nb = (int *)malloc(sizeof(int));
-    uint16_t *addr_wr = (uint16_t *)malloc(sizeof(uint16_t));
-    int *nb_wr = (int *)malloc(sizeof(int));
-
-    print_shim_info("cheri_shim", std::string(__FUNCTION__));
-
-    modbus_decompose_request(ctx, req, offset, slave_id, function, addr, nb, addr_wr, nb_wr);
+    const cheri_mapping_t *cheri_mapping = (const cheri_mapping_t *)mb_mapping;
+    cheri_view_t view = get_cheri_view(request->function);
+
+    SHIM_LOG_ENTER("cheri_shim");
 
     /**
-     * Create copies of pointers to mb_mapping and members for restoration
-     * after calling libmodbus:modbus_process_request.
-     *
-     * This allows reducing permissions to the structure and members before sending
-     * them to libmodbus:modbus_process_request.
-     *
-     * TODO:  This should probably only be done once upon initialisation and the calling
-     * application should only have the structure with reduced permissions.
+     * Select the view of mb_mapping restricted for the function in the
+     * request.  The views were derived when the mapping was created, so
+     * nothing here modifies mb_mapping.
      * */
-    mb_mapping_ = mb_mapping;
-    tab_bits_ = mb_mapping->tab_bits;
-    tab_input_bits_ = mb_mapping->tab_input_bits;
-    tab_input_registers_ = mb_mapping->tab_input_registers;
-    tab_registers_ = mb_mapping->tab_registers;
-    tab_string_ = mb_mapping->tab_string;
-
-    /* reduce mb_mapping capabilities based on the function in the request */
-    switch(*function) {
-        case MODBUS_FC_READ_COILS:
-            /* we only need to be able to read coil (tab_bits) values */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, CHERI_PERM_LOAD);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_READ_DISCRETE_INPUTS:
-            /* we only need to be able to read discrete inputs (tab_input_bits) */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, CHERI_PERM_LOAD);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_READ_HOLDING_REGISTERS:
-            /* we only need to be able to read holding registers (tab_registers) */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, CHERI_PERM_LOAD);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_READ_INPUT_REGISTERS:
-            /* we only need to be able to read input registers (tab_input_registers) */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, CHERI_PERM_LOAD);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_WRITE_SINGLE_COIL:
-        case MODBUS_FC_WRITE_MULTIPLE_COILS:
-            /* we only need to be able to store coil (tab_bits) values */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, CHERI_PERM_STORE);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_WRITE_SINGLE_REGISTER:
-        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-            /* we only need to be able to write holding registers (tab_registers) */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, CHERI_PERM_STORE);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_REPORT_SLAVE_ID:
-            /* we shouldn't need to read or write coils or registers */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_MASK_WRITE_REGISTER:
-        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
-            /* we only need to be able to read and write holding registers (tab_registers) */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, CHERI_PERM_LOAD | CHERI_PERM_STORE);
-
-            /* we need to read the serialised Macaroon (tab_string) */
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_WRITE_STRING:
-            /* we only need to be able to read and write the string (tab_string) used for Macaroons */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD | CHERI_PERM_STORE);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        case MODBUS_FC_READ_STRING:
-            /* we only need to be able to read and write the string (tab_string) used for Macaroons */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, CHERI_PERM_LOAD);
-
-            /* structure pointer should now only need to load values and capabilities */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP);
-            break;
-
-        default:
-            /* we shouldn't need to read or write coils or registers */
-            mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, 0);
-            mb_mapping->tab_input_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_input_bits, 0);
-            mb_mapping->tab_input_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_input_registers, 0);
-            mb_mapping->tab_registers = (uint16_t *)cheri_perms_and(mb_mapping->tab_registers, 0);
-            mb_mapping->tab_string = (uint8_t *)cheri_perms_and(mb_mapping->tab_string, 0);
-
-            /* structure pointer shouldn't need to be referenced at all */
-            mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping, 0);
+    mb_mapping = cheri_mapping->views[view];
+
+#if CHERI_SOFT_CHECKS
+    /* without hardware, a failed check stands in for a capability fault */
+    if(!check_cheri_view(cheri_mapping, view, request)) {
+        SHIM_LOG_ERROR("> capability check failed for %s", get_modbus_function_name(request->function));
+        *rc = shim_reply_exception(ctx, req, rsp, rsp_length,
+                                   request->function, SHIM_REJECT_CAPABILITY);
+        return NULL;
     }
+#else
+    (void)ctx;
+    (void)req;
+    (void)rsp;
+    (void)rsp_length;
+    (void)rc;
+#endif
 
     /**
      * Print the decomposed request and the resulting mb_mapping pointers
      * */
-    print_modbus_decompose_request(ctx, req, offset, slave_id, function, addr, nb, addr_wr, nb_wr);
-    std::cout << std::endl;
-    print_mb_mapping(mb_mapping);
+    if(SHIM_LOG_ENABLED(SHIM_LOG_LEVEL_TRACE)) {
+        print_modbus_decompose_request(request);
+        print_mb_mapping(mb_mapping);
+    }
 
-    /**
-     * Set state to CHERI_X (completed work within cheri_shim)
-     * Return to cheri_macaroons_shim to call libmodbus:modbus_process_request()
-     * */
-    shim_state = CHERI_X;
-    rc = modbus_process_request(ctx, req, req_length, rsp, rsp_length, mb_mapping,
-                                shim_type, shim_state);
-
-    /* restore permissions of mb_mapping and member capabilities */
-    mb_mapping = mb_mapping_;
-    mb_mapping->tab_bits = tab_bits_;
-    mb_mapping->tab_input_bits = tab_input_bits_;
-    mb_mapping->tab_input_registers = tab_input_registers_;
-    mb_mapping->tab_registers = tab_registers_;
-    mb_mapping->tab_string = tab_string_;
-
-    return rc;
+    return mb_mapping;
 }
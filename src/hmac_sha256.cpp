@@ -0,0 +1,508 @@
+#include "hmac_sha256.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * The multi-buffer kernel is written with vector extensions, so one
+ * source compiles to whatever SIMD the target has (SSE2/AVX2, NEON, or
+ * plain scalar code).  On x86-64 GCC also builds an AVX2 clone of it and
+ * the loader picks the best the CPU supports.
+ * */
+#if defined(__GNUC__) || defined(__clang__)
+#define MULTI_BUFFER_AVAILABLE 1
+typedef uint32_t lanes_t __attribute__((vector_size(4 * HMAC_SHA256_LANES)));
+#else
+#define MULTI_BUFFER_AVAILABLE 0
+#endif
+
+#if MULTI_BUFFER_AVAILABLE && defined(__x86_64__) && !defined(__clang__)
+#define LANES_TARGET __attribute__((target_clones("avx2", "default")))
+#else
+#define LANES_TARGET
+#endif
+
+static const uint32_t initial_[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t k_[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static std::atomic<int> backend_(MULTI_BUFFER_AVAILABLE ? HMAC_SHA256_MULTI_BUFFER :
+                                                          HMAC_SHA256_SCALAR);
+
+/**
+ * Jobs waiting for hmac_sha256_combined()
+ *
+ * The first caller to find no combiner running becomes the combiner: it
+ * takes every posted job, computes the batch without the lock, marks the
+ * jobs done and repeats until none are left.  Jobs posted meanwhile are
+ * taken by its next round.
+ * */
+typedef struct {
+    hmac_sha256_job_t job;
+    bool done;
+} combined_job_t;
+
+static std::mutex combine_mutex_;
+static std::condition_variable combine_done_;
+static combined_job_t *combine_pending_[HMAC_SHA256_LANES];
+static int combine_nb_pending_ = 0;
+static bool combine_running_ = false;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static void
+sha256_transform(uint32_t state[8], const uint8_t block[HMAC_SHA256_BLOCK_LENGTH])
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t t1, t2;
+    int i;
+
+    for(i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+               ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+    }
+    for(i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for(i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k_[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/* Load the key, hashed first if longer than a block, into pad XORed with value */
+static void
+hmac_pad(const uint8_t *key, size_t key_length, uint8_t value,
+         uint8_t pad[HMAC_SHA256_BLOCK_LENGTH])
+{
+    sha256_ctx_t ctx;
+    uint8_t hashed_key[HMAC_SHA256_LENGTH];
+
+    if(key_length > HMAC_SHA256_BLOCK_LENGTH) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_length);
+        sha256_final(&ctx, hashed_key);
+        key = hashed_key;
+        key_length = HMAC_SHA256_LENGTH;
+    }
+
+    memset(pad, 0, HMAC_SHA256_BLOCK_LENGTH);
+    memcpy(pad, key, key_length);
+    for(int i = 0; i < HMAC_SHA256_BLOCK_LENGTH; i++) {
+        pad[i] ^= value;
+    }
+}
+
+#if MULTI_BUFFER_AVAILABLE
+
+/**
+ * A message hashed by the multi-buffer kernel: one block (an HMAC key
+ * pad) followed by body, padded as sha256_final() pads.
+ * */
+typedef struct {
+    const uint8_t *prefix;
+    const uint8_t *body;
+    size_t body_length;
+    size_t nb_blocks;
+    uint8_t *digest;
+} sha256_stream_t;
+
+static void
+sha256_stream_init(sha256_stream_t *stream, const uint8_t *prefix,
+                   const uint8_t *body, size_t body_length, uint8_t *digest)
+{
+    /* the prefix, the body, then 0x80 and the 8 byte length */
+    stream->prefix = prefix;
+    stream->body = body;
+    stream->body_length = body_length;
+    stream->nb_blocks = 1 + (body_length + 9 + HMAC_SHA256_BLOCK_LENGTH - 1) /
+                            HMAC_SHA256_BLOCK_LENGTH;
+    stream->digest = digest;
+}
+
+/* Block index of stream, built in buffer unless it lies whole in the body */
+static const uint8_t *
+sha256_stream_block(const sha256_stream_t *stream, size_t index,
+                    uint8_t buffer[HMAC_SHA256_BLOCK_LENGTH])
+{
+    size_t start;
+    size_t n = 0;
+    uint64_t bits;
+
+    if(index == 0) {
+        return stream->prefix;
+    }
+
+    start = (index - 1) * HMAC_SHA256_BLOCK_LENGTH;
+    if(start + HMAC_SHA256_BLOCK_LENGTH <= stream->body_length) {
+        return stream->body + start;
+    }
+
+    if(start < stream->body_length) {
+        n = stream->body_length - start;
+        memcpy(buffer, stream->body + start, n);
+    }
+    memset(buffer + n, 0, HMAC_SHA256_BLOCK_LENGTH - n);
+
+    if(start <= stream->body_length) {
+        buffer[n] = 0x80;
+    }
+
+    if(index == stream->nb_blocks - 1) {
+        bits = (HMAC_SHA256_BLOCK_LENGTH + (uint64_t)stream->body_length) * 8;
+        for(int i = 0; i < 8; i++) {
+            buffer[HMAC_SHA256_BLOCK_LENGTH - 1 - i] = (uint8_t)(bits >> (8 * i));
+        }
+    }
+
+    return buffer;
+}
+
+/* sha256_transform() on one block per lane */
+LANES_TARGET static void
+sha256_transform_lanes(lanes_t state[8], const uint8_t *blocks[HMAC_SHA256_LANES])
+{
+    lanes_t w[64];
+    lanes_t a, b, c, d, e, f, g, h;
+    lanes_t t1, t2;
+    int i;
+
+    for(i = 0; i < 16; i++) {
+        for(int lane = 0; lane < HMAC_SHA256_LANES; lane++) {
+            const uint8_t *p = blocks[lane] + 4 * i;
+
+            w[i][lane] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+        }
+    }
+    for(i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for(i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k_[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * Hash up to HMAC_SHA256_LANES streams in lockstep.  Lanes whose stream
+ * is shorter (or missing) hash an idle block, and a stream's digest is
+ * taken as soon as its last block is done.
+ * */
+static void
+sha256_lanes(const sha256_stream_t *streams, int nb_streams)
+{
+    static const uint8_t idle[HMAC_SHA256_BLOCK_LENGTH] = {0};
+    uint8_t buffers[HMAC_SHA256_LANES][HMAC_SHA256_BLOCK_LENGTH];
+    const uint8_t *blocks[HMAC_SHA256_LANES];
+    lanes_t state[8];
+    lanes_t zero = {0};
+    size_t nb_blocks = 0;
+    uint32_t word;
+
+    for(int i = 0; i < 8; i++) {
+        state[i] = zero + initial_[i];
+    }
+    for(int lane = 0; lane < nb_streams; lane++) {
+        if(streams[lane].nb_blocks > nb_blocks) {
+            nb_blocks = streams[lane].nb_blocks;
+        }
+    }
+
+    for(size_t index = 0; index < nb_blocks; index++) {
+        for(int lane = 0; lane < HMAC_SHA256_LANES; lane++) {
+            blocks[lane] = (lane < nb_streams && index < streams[lane].nb_blocks) ?
+                           sha256_stream_block(&streams[lane], index, buffers[lane]) : idle;
+        }
+
+        sha256_transform_lanes(state, blocks);
+
+        for(int lane = 0; lane < nb_streams; lane++) {
+            if(index != streams[lane].nb_blocks - 1) {
+                continue;
+            }
+            for(int i = 0; i < 8; i++) {
+                word = state[i][lane];
+                streams[lane].digest[4 * i] = (uint8_t)(word >> 24);
+                streams[lane].digest[4 * i + 1] = (uint8_t)(word >> 16);
+                streams[lane].digest[4 * i + 2] = (uint8_t)(word >> 8);
+                streams[lane].digest[4 * i + 3] = (uint8_t)word;
+            }
+        }
+    }
+}
+
+/* HMAC of up to HMAC_SHA256_LANES jobs: the inner hashes in lockstep, then the outer */
+static void
+hmac_sha256_lanes(hmac_sha256_job_t *jobs, int nb_jobs)
+{
+    uint8_t inner_pads[HMAC_SHA256_LANES][HMAC_SHA256_BLOCK_LENGTH];
+    uint8_t outer_pads[HMAC_SHA256_LANES][HMAC_SHA256_BLOCK_LENGTH];
+    uint8_t inner[HMAC_SHA256_LANES][HMAC_SHA256_LENGTH];
+    sha256_stream_t streams[HMAC_SHA256_LANES];
+
+    for(int i = 0; i < nb_jobs; i++) {
+        hmac_pad(jobs[i].key, jobs[i].key_length, 0x36, inner_pads[i]);
+        hmac_pad(jobs[i].key, jobs[i].key_length, 0x5c, outer_pads[i]);
+        sha256_stream_init(&streams[i], inner_pads[i], jobs[i].data, jobs[i].length, inner[i]);
+    }
+    sha256_lanes(streams, nb_jobs);
+
+    for(int i = 0; i < nb_jobs; i++) {
+        sha256_stream_init(&streams[i], outer_pads[i], inner[i], HMAC_SHA256_LENGTH, jobs[i].mac);
+    }
+    sha256_lanes(streams, nb_jobs);
+}
+
+#endif /* MULTI_BUFFER_AVAILABLE */
+
+/******************
+ * COMMON FUNCTIONS
+ *****************/
+
+void
+sha256_init(sha256_ctx_t *ctx)
+{
+    memcpy(ctx->state, initial_, sizeof(initial_));
+    ctx->length = 0;
+    ctx->block_length = 0;
+}
+
+void
+sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t length)
+{
+    size_t n;
+
+    ctx->length += length;
+
+    if(ctx->block_length > 0) {
+        n = HMAC_SHA256_BLOCK_LENGTH - ctx->block_length;
+        if(n > length) {
+            n = length;
+        }
+        memcpy(ctx->block + ctx->block_length, data, n);
+        ctx->block_length += n;
+        data += n;
+        length -= n;
+
+        if(ctx->block_length < HMAC_SHA256_BLOCK_LENGTH) {
+            return;
+        }
+        sha256_transform(ctx->state, ctx->block);
+        ctx->block_length = 0;
+    }
+
+    for(; length >= HMAC_SHA256_BLOCK_LENGTH; data += HMAC_SHA256_BLOCK_LENGTH,
+                                              length -= HMAC_SHA256_BLOCK_LENGTH) {
+        sha256_transform(ctx->state, data);
+    }
+
+    memcpy(ctx->block, data, length);
+    ctx->block_length = length;
+}
+
+void
+sha256_final(sha256_ctx_t *ctx, uint8_t digest[HMAC_SHA256_LENGTH])
+{
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    /* 0x80, zero padding, then the message length in bits, big-endian */
+    ctx->block[ctx->block_length++] = 0x80;
+    if(ctx->block_length > HMAC_SHA256_BLOCK_LENGTH - 8) {
+        memset(ctx->block + ctx->block_length, 0, HMAC_SHA256_BLOCK_LENGTH - ctx->block_length);
+        sha256_transform(ctx->state, ctx->block);
+        ctx->block_length = 0;
+    }
+    memset(ctx->block + ctx->block_length, 0, HMAC_SHA256_BLOCK_LENGTH - 8 - ctx->block_length);
+    for(i = 0; i < 8; i++) {
+        ctx->block[HMAC_SHA256_BLOCK_LENGTH - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    sha256_transform(ctx->state, ctx->block);
+
+    for(i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void
+hmac_sha256_init(hmac_sha256_ctx_t *ctx, const uint8_t *key, size_t key_length)
+{
+    uint8_t pad[HMAC_SHA256_BLOCK_LENGTH];
+
+    /* keys longer than a block are hashed first */
+    hmac_pad(key, key_length, 0x36, pad);
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, pad, sizeof(pad));
+
+    for(int i = 0; i < HMAC_SHA256_BLOCK_LENGTH; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, pad, sizeof(pad));
+}
+
+void
+hmac_sha256_update(hmac_sha256_ctx_t *ctx, const uint8_t *data, size_t length)
+{
+    sha256_update(&ctx->inner, data, length);
+}
+
+void
+hmac_sha256_final(hmac_sha256_ctx_t *ctx, uint8_t mac[HMAC_SHA256_LENGTH])
+{
+    uint8_t inner[HMAC_SHA256_LENGTH];
+
+    sha256_final(&ctx->inner, inner);
+    sha256_update(&ctx->outer, inner, sizeof(inner));
+    sha256_final(&ctx->outer, mac);
+}
+
+void
+hmac_sha256(const uint8_t *key, size_t key_length,
+            const uint8_t *data, size_t length,
+            uint8_t mac[HMAC_SHA256_LENGTH])
+{
+    hmac_sha256_ctx_t ctx;
+
+    hmac_sha256_init(&ctx, key, key_length);
+    hmac_sha256_update(&ctx, data, length);
+    hmac_sha256_final(&ctx, mac);
+}
+
+bool
+hmac_sha256_equal(const uint8_t a[HMAC_SHA256_LENGTH], const uint8_t b[HMAC_SHA256_LENGTH])
+{
+    return hmac_sha256_truncated_equal(a, b, HMAC_SHA256_LENGTH);
+}
+
+bool
+hmac_sha256_truncated_equal(const uint8_t *a, const uint8_t *b, size_t length)
+{
+    uint8_t difference = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        difference |= a[i] ^ b[i];
+    }
+
+    return difference == 0;
+}
+
+bool
+hmac_sha256_set_backend(hmac_sha256_backend_t backend)
+{
+    if(backend == HMAC_SHA256_MULTI_BUFFER && !MULTI_BUFFER_AVAILABLE) {
+        return false;
+    }
+
+    backend_.store(backend, std::memory_order_relaxed);
+    return true;
+}
+
+hmac_sha256_backend_t
+hmac_sha256_get_backend(void)
+{
+    return (hmac_sha256_backend_t)backend_.load(std::memory_order_relaxed);
+}
+
+void
+hmac_sha256_batch(hmac_sha256_job_t *jobs, int nb_jobs)
+{
+    /* a lone job gains nothing from the lanes */
+    if(hmac_sha256_get_backend() == HMAC_SHA256_SCALAR || nb_jobs == 1) {
+        for(int i = 0; i < nb_jobs; i++) {
+            hmac_sha256(jobs[i].key, jobs[i].key_length, jobs[i].data, jobs[i].length,
+                        jobs[i].mac);
+        }
+        return;
+    }
+
+#if MULTI_BUFFER_AVAILABLE
+    for(int i = 0; i < nb_jobs; i += HMAC_SHA256_LANES) {
+        hmac_sha256_lanes(jobs + i, (nb_jobs - i < HMAC_SHA256_LANES) ? nb_jobs - i :
+                                                                       HMAC_SHA256_LANES);
+    }
+#endif
+}
+
+void
+hmac_sha256_combined(const uint8_t *key, size_t key_length,
+                     const uint8_t *data, size_t length,
+                     uint8_t mac[HMAC_SHA256_LENGTH])
+{
+    std::unique_lock<std::mutex> lock(combine_mutex_);
+    combined_job_t job = {{key, key_length, data, length, mac}, false};
+    combined_job_t *batch[HMAC_SHA256_LANES];
+    hmac_sha256_job_t jobs[HMAC_SHA256_LANES];
+    int nb_jobs;
+
+    combine_done_.wait(lock, [] { return combine_nb_pending_ < HMAC_SHA256_LANES; });
+    combine_pending_[combine_nb_pending_++] = &job;
+
+    if(combine_running_) {
+        combine_done_.wait(lock, [&job] { return job.done; });
+        return;
+    }
+
+    combine_running_ = true;
+    while(combine_nb_pending_ > 0) {
+        nb_jobs = combine_nb_pending_;
+        for(int i = 0; i < nb_jobs; i++) {
+            batch[i] = combine_pending_[i];
+            jobs[i] = batch[i]->job;
+        }
+        combine_nb_pending_ = 0;
+
+        lock.unlock();
+        hmac_sha256_batch(jobs, nb_jobs);
+        lock.lock();
+
+        for(int i = 0; i < nb_jobs; i++) {
+            batch[i]->done = true;
+        }
+        combine_done_.notify_all();
+    }
+    combine_running_ = false;
+}
@@ -0,0 +1,206 @@
+#include "macaroon_view.hpp"
+
+#include <string.h>
+
+#define PACKET_PREFIX_LENGTH 4
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/* Value of a base64 digit, either alphabet, or -1 */
+static int
+base64_value(uint8_t c)
+{
+    if(c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if(c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if(c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if(c == '+' || c == '-') {
+        return 62;
+    }
+    if(c == '/' || c == '_') {
+        return 63;
+    }
+
+    return -1;
+}
+
+/**
+ * Decode base64 input into output (at most output_length bytes).
+ *
+ * Returns the decoded length, -1 if input is not base64, or -2 if it
+ * does not fit.
+ * */
+static int
+base64_decode(const uint8_t *input, size_t length, uint8_t *output, size_t output_length)
+{
+    uint32_t bits = 0;
+    int nb_bits = 0;
+    size_t decoded = 0;
+    int value;
+
+    /* up to two padding characters */
+    for(int i = 0; i < 2 && length > 0 && input[length - 1] == '='; i++) {
+        length--;
+    }
+
+    /* a single leftover digit cannot encode a byte */
+    if(length % 4 == 1) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < length; i++) {
+        value = base64_value(input[i]);
+        if(value == -1) {
+            return -1;
+        }
+
+        bits = (bits << 6) | value;
+        nb_bits += 6;
+        if(nb_bits >= 8) {
+            nb_bits -= 8;
+            if(decoded == output_length) {
+                return -2;
+            }
+            output[decoded++] = (uint8_t)(bits >> nb_bits);
+        }
+    }
+
+    return (int)decoded;
+}
+
+static int
+hex_value(char c)
+{
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/**
+ * Parse the V1 packet at *position: its key and value.
+ *
+ * Returns false if the packet is malformed or runs past end.
+ * */
+static bool
+parse_packet(const char **position, const char *end, byte_view_t *key, byte_view_t *value)
+{
+    const char *packet = *position;
+    const char *space;
+    size_t length = 0;
+    int digit;
+
+    if(end - packet < PACKET_PREFIX_LENGTH) {
+        return false;
+    }
+
+    for(int i = 0; i < PACKET_PREFIX_LENGTH; i++) {
+        digit = hex_value(packet[i]);
+        if(digit == -1) {
+            return false;
+        }
+        length = (length << 4) | digit;
+    }
+
+    /* the length counts the prefix and the trailing newline */
+    if(length < PACKET_PREFIX_LENGTH + 2 || length > (size_t)(end - packet) ||
+       packet[length - 1] != '\n') {
+        return false;
+    }
+
+    space = (const char *)memchr(packet + PACKET_PREFIX_LENGTH, ' ',
+                                 length - PACKET_PREFIX_LENGTH - 1);
+    if(space == NULL) {
+        return false;
+    }
+
+    key->data = packet + PACKET_PREFIX_LENGTH;
+    key->length = space - key->data;
+    value->data = space + 1;
+    value->length = (packet + length - 1) - value->data;
+    *position = packet + length;
+
+    return true;
+}
+
+static bool
+key_is(const byte_view_t *key, const char *name)
+{
+    return key->length == strlen(name) && memcmp(key->data, name, key->length) == 0;
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+macaroon_view_result_t
+macaroon_view_parse(macaroon_view_t *view, const uint8_t *token, size_t token_length)
+{
+    const char *position = (const char *)view->decoded;
+    const char *end;
+    byte_view_t key;
+    byte_view_t value;
+    int length;
+
+    view->nb_caveats = 0;
+    view->signature = NULL;
+
+    length = base64_decode(token, token_length, view->decoded, sizeof(view->decoded));
+    if(length == -1 || length == 0) {
+        return MACAROON_VIEW_INVALID;
+    }
+    if(length == -2) {
+        return MACAROON_VIEW_UNSUPPORTED;
+    }
+    end = position + length;
+
+    /* V2 starts with its version byte; V1 with a hex packet length */
+    if(view->decoded[0] == 0x02) {
+        return MACAROON_VIEW_UNSUPPORTED;
+    }
+
+    if(!parse_packet(&position, end, &key, &view->location) || !key_is(&key, "location")) {
+        return MACAROON_VIEW_INVALID;
+    }
+    if(!parse_packet(&position, end, &key, &view->identifier) || !key_is(&key, "identifier")) {
+        return MACAROON_VIEW_INVALID;
+    }
+
+    while(parse_packet(&position, end, &key, &value)) {
+        if(key_is(&key, "signature")) {
+            if(value.length != HMAC_SHA256_LENGTH || position != end) {
+                return MACAROON_VIEW_INVALID;
+            }
+            view->signature = (const uint8_t *)value.data;
+            return MACAROON_VIEW_OK;
+        }
+
+        if(key_is(&key, "vid") || key_is(&key, "cl")) {
+            return MACAROON_VIEW_UNSUPPORTED;   /* a third party caveat */
+        }
+        if(!key_is(&key, "cid")) {
+            return MACAROON_VIEW_INVALID;
+        }
+        if(view->nb_caveats == MACAROON_VIEW_MAX_CAVEATS) {
+            return MACAROON_VIEW_INVALID;
+        }
+        view->caveats[view->nb_caveats++] = value;
+    }
+
+    /* no signature */
+    return MACAROON_VIEW_INVALID;
+}
@@ -849,10 +849,11 @@ int test_server(modbus_t *ctx, int use_backend)
         /* Dummy data to write */
         0x02, 0x2B, 0x00, 0x01, 0x00, 0x64
     };
-    const int INVALID_FC = 0x42;
+    /* unassigned: the shims reserve 0x41-0x47 (see tcp_frame.hpp) */
+    const int INVALID_FC = 0x48;
     const int INVALID_FC_REQ_LEN = 6;
     uint8_t invalid_fc_raw_req[] = {
-        slave, 0x42, 0x00, 0x00, 0x00, 0x00
+        slave, INVALID_FC, 0x00, 0x00, 0x00, 0x00
     };
 
     int req_length;
@@ -0,0 +1,153 @@
+#include "mapping_seqlock.hpp"
+
+#include <thread>
+
+#define TABLE_BIT(table) (1u << (table))
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/* Tables written by a function code, as a mask of TABLE_BIT()s */
+static unsigned
+tables_written(int function)
+{
+    switch(function) {
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            return TABLE_BIT(MAPPING_TABLE_BITS);
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return TABLE_BIT(MAPPING_TABLE_REGISTERS);
+        case MODBUS_FC_WRITE_STRING:
+            return TABLE_BIT(MAPPING_TABLE_STRING);
+        default:
+            return 0;
+    }
+}
+
+/* Tables read (and not written) by a function code */
+static unsigned
+tables_read(int function)
+{
+    switch(function) {
+        case MODBUS_FC_READ_COILS:
+            return TABLE_BIT(MAPPING_TABLE_BITS);
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return TABLE_BIT(MAPPING_TABLE_INPUT_BITS);
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return TABLE_BIT(MAPPING_TABLE_REGISTERS);
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return TABLE_BIT(MAPPING_TABLE_INPUT_REGISTERS);
+        case MODBUS_FC_READ_STRING:
+            return TABLE_BIT(MAPPING_TABLE_STRING);
+        default:
+            return 0;
+    }
+}
+
+/* Wait out any write in progress; returns the (even) sequence to validate against */
+static unsigned
+read_begin(table_seqlock_t *table)
+{
+    unsigned sequence;
+
+    while((sequence = table->sequence.load(std::memory_order_acquire)) & 1) {
+        std::this_thread::yield();
+    }
+
+    return sequence;
+}
+
+/* True if the table was not written since read_begin() returned sequence */
+static bool
+read_validate(table_seqlock_t *table, unsigned sequence)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return table->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+static void
+write_begin(table_seqlock_t *table)
+{
+    table->writer.lock();
+    table->sequence.store(table->sequence.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void
+write_end(table_seqlock_t *table)
+{
+    table->sequence.store(table->sequence.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_release);
+    table->writer.unlock();
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+void
+mapping_seqlock_init(mapping_seqlock_t *seqlock)
+{
+    for(int i = 0; i < MAPPING_TABLE_COUNT; i++) {
+        seqlock->tables[i].sequence.store(0, std::memory_order_relaxed);
+    }
+}
+
+int
+mapping_seqlock_process_request(mapping_seqlock_t *seqlock, modbus_t *ctx,
+                                uint8_t *req, int req_length,
+                                uint8_t *rsp, int *rsp_length,
+                                modbus_mapping_t *mb_mapping)
+{
+    int offset = modbus_get_header_length(ctx);
+    int function = (req_length > offset) ? req[offset] : -1;
+    unsigned written = tables_written(function);
+    unsigned read = tables_read(function);
+    unsigned sequences[MAPPING_TABLE_COUNT];
+    bool consistent;
+    int rc;
+
+    /* every function writes at most one table, so writers cannot deadlock */
+    if(written) {
+        for(int i = 0; i < MAPPING_TABLE_COUNT; i++) {
+            if(written & TABLE_BIT(i)) {
+                write_begin(&seqlock->tables[i]);
+            }
+        }
+
+        rc = modbus_process_request(ctx, req, req_length, rsp, rsp_length, mb_mapping);
+
+        for(int i = 0; i < MAPPING_TABLE_COUNT; i++) {
+            if(written & TABLE_BIT(i)) {
+                write_end(&seqlock->tables[i]);
+            }
+        }
+
+        return rc;
+    }
+
+    /* the response is built from a copy of the table, so it can be rebuilt */
+    do {
+        for(int i = 0; i < MAPPING_TABLE_COUNT; i++) {
+            if(read & TABLE_BIT(i)) {
+                sequences[i] = read_begin(&seqlock->tables[i]);
+            }
+        }
+
+        rc = modbus_process_request(ctx, req, req_length, rsp, rsp_length, mb_mapping);
+
+        consistent = true;
+        for(int i = 0; i < MAPPING_TABLE_COUNT; i++) {
+            if((read & TABLE_BIT(i)) && !read_validate(&seqlock->tables[i], sequences[i])) {
+                consistent = false;
+            }
+        }
+    } while(!consistent);
+
+    return rc;
+}
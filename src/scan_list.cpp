@@ -0,0 +1,241 @@
+#include "scan_list.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <errno.h>
+
+#include "shim_async.hpp"
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static bool
+is_bit_table(mapping_table_t table)
+{
+    return table == MAPPING_TABLE_BITS || table == MAPPING_TABLE_INPUT_BITS;
+}
+
+/* Most addresses a single read of table may cover */
+static int
+max_read(mapping_table_t table)
+{
+    return is_bit_table(table) ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+}
+
+/* Scatter the values of a completed read to its points, or invalidate them */
+static void
+request_completed(void *user, int rc)
+{
+    scan_completion_t *completion = (scan_completion_t *)user;
+    scan_list_t *list = completion->list;
+    const scan_request_t *request = &list->requests[completion->request];
+    scan_point_t *point;
+    size_t index;
+
+    if(rc == -1) {
+        list->nb_failed++;
+        list->error = errno;
+    }
+
+    for(size_t i = request->first; i < request->first + request->nb_points; i++) {
+        point = &list->points[list->order[i]];
+        index = request->buffer + (point->addr - request->addr);
+
+        point->valid = (rc != -1);
+        if(point->valid) {
+            point->value = is_bit_table(request->table) ? list->bits[index] :
+                                                          list->registers[index];
+        }
+    }
+}
+
+/* Submit one read of the plan through async */
+static int
+submit_request(scan_list_t *list, shim_async_t *async, size_t r)
+{
+    const scan_request_t *request = &list->requests[r];
+    scan_completion_t *completion = &list->completions[r];
+
+    switch(request->table) {
+        case MAPPING_TABLE_BITS:
+            return shim_async_read_bits(async, request->addr, request->nb,
+                                        &list->bits[request->buffer],
+                                        request_completed, completion);
+        case MAPPING_TABLE_INPUT_BITS:
+            return shim_async_read_input_bits(async, request->addr, request->nb,
+                                              &list->bits[request->buffer],
+                                              request_completed, completion);
+        case MAPPING_TABLE_REGISTERS:
+            return shim_async_read_registers(async, request->addr, request->nb,
+                                             &list->registers[request->buffer],
+                                             request_completed, completion);
+        case MAPPING_TABLE_INPUT_REGISTERS:
+            return shim_async_read_input_registers(async, request->addr, request->nb,
+                                                   &list->registers[request->buffer],
+                                                   request_completed, completion);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+void
+scan_list_init(scan_list_t *list, int max_gap)
+{
+    list->max_gap = (max_gap < 0) ? 0 : max_gap;
+    list->points.clear();
+    list->order.clear();
+    list->requests.clear();
+    list->completions.clear();
+    list->bits.clear();
+    list->registers.clear();
+    list->nb_failed = 0;
+    list->error = 0;
+}
+
+int
+scan_list_add(scan_list_t *list, mapping_table_t table, uint16_t addr)
+{
+    scan_point_t point;
+
+    if(table >= MAPPING_TABLE_STRING) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    point.table = table;
+    point.addr = addr;
+    point.value = 0;
+    point.valid = false;
+    list->points.push_back(point);
+
+    return (int)list->points.size() - 1;
+}
+
+/**
+ * Points are sorted, then swept once: a point joins the current read if
+ * it is in the same table, within max_gap of its last address, and the
+ * read stays within the protocol limit; otherwise it starts a new read.
+ * On a line of points this greedy sweep gives the fewest reads.
+ * */
+int
+scan_list_compile(scan_list_t *list)
+{
+    const std::vector<scan_point_t> &points = list->points;
+    scan_request_t request;
+    scan_request_t *last;
+    size_t nb_bits = 0;
+    size_t nb_registers = 0;
+    int span;
+
+    list->order.resize(points.size());
+    for(size_t i = 0; i < points.size(); i++) {
+        list->order[i] = i;
+    }
+    std::sort(list->order.begin(), list->order.end(), [&points](size_t a, size_t b) {
+        return points[a].table != points[b].table ? points[a].table < points[b].table :
+                                                    points[a].addr < points[b].addr;
+    });
+
+    list->requests.clear();
+    for(size_t i = 0; i < list->order.size(); i++) {
+        const scan_point_t &point = points[list->order[i]];
+
+        last = list->requests.empty() ? NULL : &list->requests.back();
+        if(last != NULL && last->table == point.table) {
+            span = point.addr - last->addr + 1;
+            if(span <= last->nb + list->max_gap + 1 && span <= max_read(point.table)) {
+                last->nb = std::max(last->nb, span);
+                last->nb_points++;
+                continue;
+            }
+        }
+
+        request.table = point.table;
+        request.addr = point.addr;
+        request.nb = 1;
+        request.first = i;
+        request.nb_points = 1;
+        list->requests.push_back(request);
+    }
+
+    /* every read gets its own buffer, as reads are in flight together */
+    list->completions.resize(list->requests.size());
+    for(size_t r = 0; r < list->requests.size(); r++) {
+        scan_request_t *plan = &list->requests[r];
+
+        if(is_bit_table(plan->table)) {
+            plan->buffer = nb_bits;
+            nb_bits += plan->nb;
+        } else {
+            plan->buffer = nb_registers;
+            nb_registers += plan->nb;
+        }
+        list->completions[r].list = list;
+        list->completions[r].request = r;
+    }
+    list->bits.assign(nb_bits, 0);
+    list->registers.assign(nb_registers, 0);
+
+    SHIM_LOG_DEBUG("> scan list: %zu points in %zu requests",
+                   points.size(), list->requests.size());
+
+    return (int)list->requests.size();
+}
+
+int
+scan_list_execute(scan_list_t *list, modbus_t *ctx, shim_t shim_type)
+{
+    shim_async_t async;
+
+    SHIM_LOG_ENTER("scan_list");
+
+    list->nb_failed = 0;
+    list->error = 0;
+
+    shim_async_init(&async, ctx, SHIM_ASYNC_DEFAULT_WINDOW, shim_type);
+
+    for(size_t r = 0; r < list->requests.size(); r++) {
+        if(submit_request(list, &async, r) == -1) {
+            request_completed(&list->completions[r], -1);
+        }
+    }
+
+    /* a failed flush has completed every read left with -1 */
+    shim_async_flush(&async);
+
+    if(list->nb_failed > 0) {
+        errno = list->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+scan_list_run(scan_list_t *list, modbus_t *ctx, shim_t shim_type,
+              int period_ms, scan_callback_t callback, void *user)
+{
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    int rc;
+
+    do {
+        rc = scan_list_execute(list, ctx, shim_type);
+
+        next += std::chrono::milliseconds(period_ms);
+        if(next < std::chrono::steady_clock::now()) {
+            next = std::chrono::steady_clock::now();
+        }
+        if(!callback(list, rc, user)) {
+            break;
+        }
+
+        std::this_thread::sleep_until(next);
+    } while(true);
+}
@@ -0,0 +1,754 @@
+#include "server_loop.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Number of events handled per call to epoll_wait() */
+#define SERVER_MAX_EVENTS 64
+
+/* Timeout for epoll_wait(), bounding how long a stop request goes unnoticed */
+#define SERVER_POLL_TIMEOUT_MS 100
+
+/**
+ * State for a single client connection
+ *
+ * Every connection has its own libmodbus context (bound to the
+ * connection socket with modbus_set_socket()), its own buffers and its
+ * own shim session, so partially-received requests and installed
+ * Macaroons never interfere with each other.
+ *
+ * With a worker pool, the network thread copies complete requests to
+ * pending and at most one worker at a time (scheduled) takes them off,
+ * so requests are answered in the order they arrived.  The members
+ * after lock are only accessed under it.
+ *
+ * The socket never blocks: replies are queued in output and sent as the
+ * socket takes them.  While more than SERVER_MAX_OUTPUT bytes are
+ * waiting, no more requests are read or answered for the connection.
+ * */
+typedef struct {
+    int socket;
+    int epfd;                               /* the event loop waiting on socket */
+    modbus_t *ctx;
+    shim_session_t session;
+    int query_length;                       /* bytes currently buffered */
+    uint8_t query[SERVER_MAX_ADU_LENGTH];
+    uint8_t rsp[SERVER_MAX_ADU_LENGTH];
+
+    std::mutex lock;
+    std::deque<std::vector<uint8_t>> pending;   /* requests in arrival order */
+    std::vector<std::vector<uint8_t>> spare;    /* request buffers for reuse */
+    bool scheduled;                         /* queued on, or run by, a worker */
+    bool closed;                            /* dropped by the network thread */
+    std::vector<uint8_t> output;            /* replies not yet (fully) sent */
+    size_t output_sent;                     /* bytes of output already sent */
+    uint32_t events;                        /* the epoll events waited for */
+} connection_t;
+
+/* Worker threads, and the connections with requests waiting for them */
+typedef struct {
+    modbus_mapping_t *mb_mapping;
+    shim_t shim_type;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<connection_t *> runnable;
+    bool stop;
+    std::vector<std::thread> threads;
+} worker_pool_t;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static connection_t *
+connection_new(int s, int epfd, int debug, mapping_seqlock_t *seqlock)
+{
+    connection_t *conn = new connection_t;
+
+    /* ip is unused for an accepted socket */
+    conn->ctx = modbus_new_tcp(NULL, 0);
+    if(conn->ctx == NULL) {
+        delete conn;
+        return NULL;
+    }
+
+    modbus_set_socket(conn->ctx, s);
+    modbus_set_debug(conn->ctx, debug);
+
+    shim_session_init(&conn->session, seqlock);
+
+    conn->socket = s;
+    conn->epfd = epfd;
+    conn->query_length = 0;
+    conn->scheduled = false;
+    conn->closed = false;
+    conn->output_sent = 0;
+    conn->events = 0;
+
+    return conn;
+}
+
+static void
+connection_free(connection_t *conn)
+{
+    close(conn->socket);
+
+    /* the socket is already closed, don't let libmodbus close it again */
+    modbus_set_socket(conn->ctx, -1);
+    modbus_free(conn->ctx);
+
+    delete conn;
+}
+
+/**
+ * Stop serving a connection.  If a worker still has it, the worker
+ * frees it when done.
+ * */
+static void
+connection_close(int epfd, connection_t *conn)
+{
+    bool scheduled;
+
+    /* under the lock, so a worker cannot wait on the socket again afterwards */
+    {
+        std::lock_guard<std::mutex> lock(conn->lock);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+        conn->closed = true;
+        scheduled = conn->scheduled;
+    }
+
+    if(!scheduled) {
+        connection_free(conn);
+    }
+}
+
+/**
+ * Length of the first complete request in the connection buffer,
+ * 0 if more bytes are needed, -1 if the buffered data cannot be a
+ * valid Modbus/TCP request.
+ * */
+static int
+connection_frame_length(const connection_t *conn)
+{
+    int length;
+
+    if(conn->query_length < MBAP_PREFIX_LENGTH) {
+        return 0;
+    }
+
+    /* protocol identifier must be 0 for Modbus */
+    if(conn->query[2] != 0 || conn->query[3] != 0) {
+        return -1;
+    }
+
+    length = (conn->query[MBAP_LENGTH_OFFSET] << 8) | conn->query[MBAP_LENGTH_OFFSET + 1];
+
+    /* unit identifier and function code at least */
+    if(length < 2 || MBAP_PREFIX_LENGTH + length > SERVER_MAX_ADU_LENGTH) {
+        return -1;
+    }
+
+    if(conn->query_length < MBAP_PREFIX_LENGTH + length) {
+        return 0;
+    }
+
+    return MBAP_PREFIX_LENGTH + length;
+}
+
+/* Remove the first length bytes from the connection buffer */
+static void
+connection_consume(connection_t *conn, int length)
+{
+    memmove(conn->query, conn->query + length, conn->query_length - length);
+    conn->query_length -= length;
+}
+
+/* Bytes of reply queued for a connection and not yet sent */
+static size_t
+connection_backlog(const connection_t *conn)
+{
+    return conn->output.size() - conn->output_sent;
+}
+
+/**
+ * Wait for what the connection can make progress on: more requests,
+ * unless its replies have backed up, and room to send the replies
+ * while any are queued.  Called with conn->lock held.
+ * */
+static void
+connection_update_events(connection_t *conn)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if(conn->closed) {
+        return;
+    }
+
+    if(connection_backlog(conn) < SERVER_MAX_OUTPUT) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if(connection_backlog(conn) > 0) {
+        events |= EPOLLOUT;
+    }
+
+    if(events == conn->events) {
+        return;
+    }
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if(epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->socket, &ev) == 0) {
+        conn->events = events;
+    }
+}
+
+/**
+ * Send as much of the queued replies as the socket takes without
+ * blocking.  Called with conn->lock held.
+ *
+ * Returns -1 if the connection should be closed
+ * */
+static int
+connection_flush(connection_t *conn)
+{
+    ssize_t rc;
+
+    while(conn->output_sent < conn->output.size()) {
+        rc = send(conn->socket, conn->output.data() + conn->output_sent,
+                  conn->output.size() - conn->output_sent, MSG_NOSIGNAL);
+        if(rc == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        conn->output_sent += rc;
+    }
+
+    if(conn->output_sent == conn->output.size()) {
+        conn->output.clear();
+        conn->output_sent = 0;
+    }
+
+    connection_update_events(conn);
+
+    return 0;
+}
+
+/**
+ * Run a single request through the shims and queue the reply to it
+ *
+ * Returns -1 if the connection should be closed
+ * */
+static int
+connection_handle(connection_t *conn, uint8_t *req, int req_length,
+                  modbus_mapping_t *mb_mapping, shim_t shim_type)
+{
+    int rc;
+    int rsp_length = 0;
+
+    rc = modbus_process_request(conn->ctx, req, req_length, conn->rsp, &rsp_length,
+                                mb_mapping, &conn->session, shim_type);
+    if(rc == -1) {
+        return -1;
+    }
+
+    if(rsp_length <= 0) {
+        return 0;
+    }
+
+    /* as libmodbus:modbus_reply() would before sending the response */
+    MODBUS_SET_INT16_TO_INT8(conn->rsp, MBAP_LENGTH_OFFSET, rsp_length - MBAP_PREFIX_LENGTH);
+
+    std::lock_guard<std::mutex> lock(conn->lock);
+
+    /* drop what has been sent, so output never holds more than the backlog */
+    if(conn->output_sent > 0) {
+        conn->output.erase(conn->output.begin(), conn->output.begin() + conn->output_sent);
+        conn->output_sent = 0;
+    }
+    conn->output.insert(conn->output.end(), conn->rsp, conn->rsp + rsp_length);
+
+    return connection_flush(conn);
+}
+
+/* Whether the connection has too many replies waiting to take more requests */
+static bool
+connection_backed_up(connection_t *conn)
+{
+    std::lock_guard<std::mutex> lock(conn->lock);
+
+    return connection_backlog(conn) >= SERVER_MAX_OUTPUT;
+}
+
+/**
+ * Process every complete request buffered for a connection on the
+ * network thread
+ *
+ * Returns -1 if the connection should be closed
+ * */
+static int
+connection_process(connection_t *conn, modbus_mapping_t *mb_mapping, shim_t shim_type)
+{
+    int frame_length;
+
+    for(;;) {
+        /* the rest stay buffered until the client reads its replies */
+        if(connection_backed_up(conn)) {
+            return 0;
+        }
+
+        /* frames are parsed in place from the start of the buffer */
+        frame_length = connection_frame_length(conn);
+        if(frame_length <= 0) {
+            return frame_length;
+        }
+
+        if(connection_handle(conn, conn->query, frame_length, mb_mapping, shim_type) == -1) {
+            return -1;
+        }
+
+        connection_consume(conn, frame_length);
+    }
+}
+
+/* Queue conn, newly scheduled, for the next free worker */
+static void
+worker_pool_schedule(worker_pool_t *pool, connection_t *conn)
+{
+    std::lock_guard<std::mutex> lock(pool->lock);
+
+    pool->runnable.push_back(conn);
+    pool->ready.notify_one();
+}
+
+/**
+ * Queue every complete request buffered for a connection for the
+ * workers, scheduling the connection unless a worker has it already
+ *
+ * Returns -1 if the connection should be closed
+ * */
+static int
+connection_dispatch(connection_t *conn, worker_pool_t *pool)
+{
+    int frame_length;
+    bool schedule = false;
+
+    for(;;) {
+        frame_length = connection_frame_length(conn);
+        if(frame_length <= 0) {
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(conn->lock);
+
+            /* a well-behaved client waits for its replies */
+            if(conn->pending.size() >= SERVER_MAX_PENDING) {
+                return -1;
+            }
+
+            conn->pending.emplace_back();
+            if(!conn->spare.empty()) {
+                conn->pending.back().swap(conn->spare.back());
+                conn->spare.pop_back();
+            }
+            conn->pending.back().assign(conn->query, conn->query + frame_length);
+
+            if(!conn->scheduled) {
+                conn->scheduled = true;
+                schedule = true;
+            }
+        }
+
+        connection_consume(conn, frame_length);
+    }
+
+    if(schedule) {
+        worker_pool_schedule(pool, conn);
+    }
+
+    return frame_length;
+}
+
+/**
+ * The socket of a connection has room for more of its replies: send
+ * them and, once fewer than SERVER_MAX_OUTPUT bytes are waiting, carry
+ * on with the requests held back meanwhile
+ *
+ * Returns -1 if the connection should be closed
+ * */
+static int
+connection_resume(connection_t *conn, worker_pool_t *pool,
+                  modbus_mapping_t *mb_mapping, shim_t shim_type)
+{
+    bool schedule = false;
+
+    {
+        std::lock_guard<std::mutex> lock(conn->lock);
+
+        if(connection_flush(conn) == -1) {
+            return -1;
+        }
+
+        if(connection_backlog(conn) >= SERVER_MAX_OUTPUT) {
+            return 0;
+        }
+
+        /* a worker gave the connection up while its replies were backed up */
+        if(!conn->pending.empty() && !conn->scheduled) {
+            conn->scheduled = true;
+            schedule = true;
+        }
+    }
+
+    if(pool->threads.empty()) {
+        return connection_process(conn, mb_mapping, shim_type);
+    }
+
+    if(schedule) {
+        worker_pool_schedule(pool, conn);
+    }
+
+    return 0;
+}
+
+/**
+ * Worker thread: take a connection and answer its queued requests in
+ * order until none are left, or until the client has to read its
+ * replies before more are worth answering
+ * */
+static void
+worker_run(worker_pool_t *pool)
+{
+    connection_t *conn;
+    std::vector<uint8_t> frame;
+    bool failed;
+    bool closed;
+
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->lock);
+            pool->ready.wait(lock, [pool] { return pool->stop || !pool->runnable.empty(); });
+            if(pool->runnable.empty()) {
+                return;
+            }
+            conn = pool->runnable.front();
+            pool->runnable.pop_front();
+        }
+
+        failed = false;
+        for(;;) {
+            {
+                std::lock_guard<std::mutex> lock(conn->lock);
+
+                if(frame.capacity() > 0) {
+                    conn->spare.emplace_back();
+                    conn->spare.back().swap(frame);
+                }
+
+                /* once unscheduled, the network thread may free conn */
+                if(conn->closed || failed) {
+                    conn->pending.clear();
+                    conn->scheduled = false;
+                    closed = conn->closed;
+                    break;
+                }
+
+                /**
+                 * Rather than wait on a client that is not reading, give
+                 * the connection back; the network thread schedules it
+                 * again once the replies have been sent
+                 * */
+                if(conn->pending.empty() || connection_backlog(conn) >= SERVER_MAX_OUTPUT) {
+                    conn->scheduled = false;
+                    closed = false;
+                    break;
+                }
+
+                frame.swap(conn->pending.front());
+                conn->pending.pop_front();
+            }
+
+            if(connection_handle(conn, frame.data(), (int)frame.size(),
+                                 pool->mb_mapping, pool->shim_type) == -1) {
+                /* the network thread sees the hang-up and closes the connection */
+                shutdown(conn->socket, SHUT_RDWR);
+                failed = true;
+            }
+        }
+
+        if(closed) {
+            connection_free(conn);
+        }
+    }
+}
+
+static void
+worker_pool_start(worker_pool_t *pool, int nb_workers,
+                  modbus_mapping_t *mb_mapping, shim_t shim_type)
+{
+    pool->mb_mapping = mb_mapping;
+    pool->shim_type = shim_type;
+    pool->stop = false;
+
+    for(int i = 0; i < nb_workers; i++) {
+        pool->threads.emplace_back(worker_run, pool);
+    }
+}
+
+/* Let the workers finish the requests already queued, then join them */
+static void
+worker_pool_stop(worker_pool_t *pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->lock);
+        pool->stop = true;
+        pool->ready.notify_all();
+    }
+
+    for(std::thread &thread : pool->threads) {
+        thread.join();
+    }
+    pool->threads.clear();
+}
+
+/* Wait for connections on the listening socket (again) */
+static int
+listen_start(int epfd, int server_socket)
+{
+    struct epoll_event ev;
+
+    /* the listening socket is identified by a NULL data pointer */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, server_socket, &ev);
+}
+
+/**
+ * Accept every pending connection
+ *
+ * spare_fd is a descriptor held in reserve: when the process runs out,
+ * it is released to accept the waiting connection and close it at once.
+ * Otherwise the connection stays pending and the level-triggered
+ * listening socket is reported again on every wait.  Without a spare,
+ * the listening socket is taken out of the loop (listening = false)
+ * until descriptors free up.
+ * */
+static void
+accept_connections(int epfd, int server_socket,
+                   std::unordered_set<connection_t *> &connections,
+                   mapping_seqlock_t *seqlock,
+                   const server_config_t *config,
+                   int *spare_fd, bool *listening)
+{
+    struct epoll_event ev;
+    connection_t *conn;
+    int s;
+    int flag = 1;
+
+    for(;;) {
+        s = accept(server_socket, NULL, NULL);
+        if(s == -1) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            if(errno == EMFILE || errno == ENFILE) {
+                if(*spare_fd != -1) {
+                    close(*spare_fd);
+                    s = accept(server_socket, NULL, NULL);
+                    if(s != -1) {
+                        close(s);
+                    }
+                    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+                    /* accept() reports EMFILE before it finds the queue empty */
+                    if(s == -1) {
+                        return;
+                    }
+                    continue;
+                }
+
+                epoll_ctl(epfd, EPOLL_CTL_DEL, server_socket, NULL);
+                *listening = false;
+            }
+
+            /* EAGAIN: no more pending connections */
+            return;
+        }
+
+        if((int)connections.size() >= config->max_connections) {
+            close(s);
+            continue;
+        }
+
+        /* replies are queued and sent as the socket takes them (see connection_flush()) */
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        conn = connection_new(s, epfd, config->debug, seqlock);
+        if(conn == NULL) {
+            close(s);
+            continue;
+        }
+
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) == -1) {
+            connection_free(conn);
+            continue;
+        }
+
+        connections.insert(conn);
+    }
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+int
+modbus_server_loop(int server_socket, modbus_mapping_t *mb_mapping,
+                   shim_t shim_type, const server_config_t *config)
+{
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int epfd;
+    int spare_fd;
+    bool listening = true;
+    int nfds;
+    int i;
+    int rc;
+    std::unordered_set<connection_t *> connections;
+    mapping_seqlock_t seqlock;
+    worker_pool_t pool;
+
+    /* accept() is driven by readiness, so the listening socket must not block */
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL, 0) | O_NONBLOCK);
+
+    epfd = epoll_create1(0);
+    if(epfd == -1) {
+        return -1;
+    }
+
+    if(listen_start(epfd, server_socket) == -1) {
+        close(epfd);
+        return -1;
+    }
+
+    /* released to turn connections away when out of descriptors (see accept_connections()) */
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* every connection reads and writes mb_mapping through the same seqlock */
+    mapping_seqlock_init(&seqlock);
+    worker_pool_start(&pool, config->nb_workers, mb_mapping, shim_type);
+
+    while(config->stop == NULL || !config->stop->load()) {
+        /* closed connections may have freed enough descriptors to accept again */
+        if(!listening) {
+            if(spare_fd == -1) {
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            if(spare_fd != -1 && listen_start(epfd, server_socket) == 0) {
+                listening = true;
+            }
+        }
+
+        nfds = epoll_wait(epfd, events, SERVER_MAX_EVENTS, SERVER_POLL_TIMEOUT_MS);
+        if(nfds == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for(i = 0; i < nfds; i++) {
+            connection_t *conn = (connection_t *)events[i].data.ptr;
+
+            if(conn == NULL) {
+                accept_connections(epfd, server_socket, connections, &seqlock, config,
+                                   &spare_fd, &listening);
+                continue;
+            }
+
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                connections.erase(conn);
+                connection_close(epfd, conn);
+                continue;
+            }
+
+            if(events[i].events & EPOLLOUT) {
+                if(connection_resume(conn, &pool, mb_mapping, shim_type) == -1) {
+                    connections.erase(conn);
+                    connection_close(epfd, conn);
+                    continue;
+                }
+            }
+
+            /* the buffer only fills with requests held back for a backed-up client */
+            if(!(events[i].events & (EPOLLIN | EPOLLRDHUP)) ||
+               conn->query_length == SERVER_MAX_ADU_LENGTH) {
+                continue;
+            }
+
+            /**
+             * Level-triggered: a single recv() per event never blocks, and
+             * anything left in the socket is reported again on the next wait
+             * */
+            rc = recv(conn->socket, conn->query + conn->query_length,
+                      SERVER_MAX_ADU_LENGTH - conn->query_length, 0);
+            if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if(rc <= 0) {
+                connections.erase(conn);
+                connection_close(epfd, conn);
+                continue;
+            }
+            conn->query_length += rc;
+
+            if(config->nb_workers > 0) {
+                rc = connection_dispatch(conn, &pool);
+            } else {
+                rc = connection_process(conn, mb_mapping, shim_type);
+            }
+
+            if(rc == -1) {
+                connections.erase(conn);
+                connection_close(epfd, conn);
+            }
+        }
+    }
+
+    /* once the workers are done, nothing else refers to the connections */
+    worker_pool_stop(&pool);
+
+    for(connection_t *conn : connections) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+        connection_free(conn);
+    }
+    if(spare_fd != -1) {
+        close(spare_fd);
+    }
+    close(epfd);
+
+    return 0;
+}
@@ -0,0 +1,374 @@
+#include "shim_async.hpp"
+
+#include <string>
+#include <errno.h>
+
+#include "macaroons_shim.hpp"
+#include "tcp_frame.hpp"
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static bool
+uses_macaroons(const shim_async_t *async)
+{
+    return async->shim_type == MACAROONS || async->shim_type == CHERI_MACAROONS;
+}
+
+/* The pending transaction answered by transaction_id, or NULL */
+static shim_transaction_t *
+find_transaction(shim_async_t *async, int transaction_id)
+{
+    for(int i = 0; i < async->window; i++) {
+        if(async->transactions[i].pending &&
+           async->transactions[i].transaction_id == transaction_id) {
+            return &async->transactions[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Retire transaction and report rc (with errno) to its callback */
+static void
+complete(shim_async_t *async, shim_transaction_t *transaction, int rc, int error)
+{
+    transaction->pending = false;
+    async->nb_pending--;
+
+    /* the slot is free again, so the callback may submit another request */
+    errno = error;
+    transaction->callback(transaction->user, rc);
+}
+
+/* Complete every pending transaction with -1 and error */
+static void
+fail_all(shim_async_t *async, int error)
+{
+    for(int i = 0; i < async->window; i++) {
+        if(async->transactions[i].pending) {
+            complete(async, &async->transactions[i], -1, error);
+        }
+    }
+
+    errno = error;
+}
+
+/**
+ * Decode the checked response rsp to transaction into its dest, as the
+ * synchronous shim functions do.
+ *
+ * Returns what the synchronous call returns.
+ * */
+static int
+decode_response(const shim_transaction_t *transaction, const uint8_t *rsp, int rsp_length)
+{
+    int offset = MBAP_HEADER_LENGTH;
+    int nb = transaction->nb;
+    int nb_bytes;
+    uint8_t *bits;
+    uint16_t *registers;
+
+    switch(transaction->function) {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            nb_bytes = (nb / 8) + ((nb % 8) ? 1 : 0);
+            if(rsp[offset + 1] != nb_bytes || rsp_length < offset + 2 + nb_bytes) {
+                errno = EMBBADDATA;
+                return -1;
+            }
+            bits = (uint8_t *)transaction->dest;
+            for(int i = 0; i < nb; i++) {
+                bits[i] = (rsp[offset + 2 + (i / 8)] >> (i % 8)) & 1;
+            }
+            return nb;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            if(rsp[offset + 1] != nb * 2 || rsp_length < offset + 2 + nb * 2) {
+                errno = EMBBADDATA;
+                return -1;
+            }
+            registers = (uint16_t *)transaction->dest;
+            for(int i = 0; i < nb; i++) {
+                registers[i] = MODBUS_GET_INT16_FROM_INT8(rsp, offset + 2 + (i * 2));
+            }
+            return nb;
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            return 1;
+        default:
+            return nb;
+    }
+}
+
+/**
+ * Send pdu (for nb items at addr) as a new transaction, with a Macaroon
+ * attenuated to it in the Macaroons modes, making room in the window
+ * first if needed.
+ *
+ * Returns the transaction id, or -1 with errno set.
+ * */
+static int
+submit(shim_async_t *async, int addr, int nb, const uint8_t *pdu, int pdu_length,
+       void *dest, shim_async_callback_t callback, void *user)
+{
+    int function = pdu[0];
+    std::string token;
+    shim_transaction_t *transaction;
+    int tid;
+
+    while(async->nb_pending >= async->window) {
+        if(shim_async_poll(async) == -1) {
+            return -1;
+        }
+    }
+
+    if(uses_macaroons(async) && modbus_session_is_open_macaroons(async->ctx)) {
+        tid = modbus_send_session_request_macaroons(async->ctx, pdu, pdu_length);
+    } else if(uses_macaroons(async)) {
+        /* single writes are authorised for their address alone */
+        if(attenuate_client_macaroon(function, addr,
+               (function == MODBUS_FC_WRITE_SINGLE_COIL ||
+                function == MODBUS_FC_WRITE_SINGLE_REGISTER) ? 0 : nb, &token) == -1) {
+            return -1;
+        }
+
+        /* a token written in chunks reads their responses, so nothing may be in flight */
+        if(token.size() > MODBUS_MAX_STRING_LENGTH && shim_async_flush(async) == -1) {
+            return -1;
+        }
+
+        tid = modbus_send_request_macaroons(async->ctx, token, pdu, pdu_length);
+    } else {
+        tid = tcp_frame_send(async->ctx, pdu, pdu_length);
+    }
+    if(tid == -1) {
+        return -1;
+    }
+
+    /* a free slot exists: nb_pending < window */
+    transaction = async->transactions;
+    while(transaction->pending) {
+        transaction++;
+    }
+
+    transaction->pending = true;
+    transaction->transaction_id = tid;
+    transaction->function = function;
+    transaction->nb = nb;
+    transaction->dest = dest;
+    transaction->callback = callback;
+    transaction->user = user;
+    async->nb_pending++;
+
+    return tid;
+}
+
+/* Submit a read of nb items at addr (function) */
+static int
+submit_read(shim_async_t *async, int function, int addr, int nb, int max_nb, void *dest,
+            shim_async_callback_t callback, void *user)
+{
+    uint8_t pdu[5];
+
+    if(nb < 1 || nb > max_nb) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = function;
+    MODBUS_SET_INT16_TO_INT8(pdu, 1, addr);
+    MODBUS_SET_INT16_TO_INT8(pdu, 3, nb);
+
+    return submit(async, addr, nb, pdu, sizeof(pdu), dest, callback, user);
+}
+
+/* Submit a write of a single coil or register (function) */
+static int
+submit_write_single(shim_async_t *async, int function, int addr, uint16_t value,
+                    shim_async_callback_t callback, void *user)
+{
+    uint8_t pdu[5];
+
+    pdu[0] = function;
+    MODBUS_SET_INT16_TO_INT8(pdu, 1, addr);
+    MODBUS_SET_INT16_TO_INT8(pdu, 3, value);
+
+    return submit(async, addr, 1, pdu, sizeof(pdu), NULL, callback, user);
+}
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+void
+shim_async_init(shim_async_t *async, modbus_t *ctx, int window, shim_t shim_type)
+{
+    async->ctx = ctx;
+    async->shim_type = shim_type;
+    async->window = (window < 1) ? 1 :
+                    (window > SHIM_ASYNC_MAX_WINDOW) ? SHIM_ASYNC_MAX_WINDOW : window;
+    async->nb_pending = 0;
+
+    for(int i = 0; i < SHIM_ASYNC_MAX_WINDOW; i++) {
+        async->transactions[i].pending = false;
+    }
+}
+
+int
+shim_async_read_bits(shim_async_t *async, int addr, int nb, uint8_t *dest,
+                     shim_async_callback_t callback, void *user)
+{
+    SHIM_LOG_ENTER("shim_async");
+
+    return submit_read(async, MODBUS_FC_READ_COILS, addr, nb, MODBUS_MAX_READ_BITS,
+                       dest, callback, user);
+}
+
+int
+shim_async_read_input_bits(shim_async_t *async, int addr, int nb, uint8_t *dest,
+                           shim_async_callback_t callback, void *user)
+{
+    SHIM_LOG_ENTER("shim_async");
+
+    return submit_read(async, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb, MODBUS_MAX_READ_BITS,
+                       dest, callback, user);
+}
+
+int
+shim_async_read_registers(shim_async_t *async, int addr, int nb, uint16_t *dest,
+                          shim_async_callback_t callback, void *user)
+{
+    SHIM_LOG_ENTER("shim_async");
+
+    return submit_read(async, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                       MODBUS_MAX_READ_REGISTERS, dest, callback, user);
+}
+
+int
+shim_async_read_input_registers(shim_async_t *async, int addr, int nb, uint16_t *dest,
+                                shim_async_callback_t callback, void *user)
+{
+    SHIM_LOG_ENTER("shim_async");
+
+    return submit_read(async, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                       MODBUS_MAX_READ_REGISTERS, dest, callback, user);
+}
+
+int
+shim_async_write_bit(shim_async_t *async, int addr, int status,
+                     shim_async_callback_t callback, void *user)
+{
+    SHIM_LOG_ENTER("shim_async");
+
+    return submit_write_single(async, MODBUS_FC_WRITE_SINGLE_COIL, addr,
+                               status ? 0xFF00 : 0, callback, user);
+}
+
+int
+shim_async_write_register(shim_async_t *async, int addr, uint16_t value,
+                          shim_async_callback_t callback, void *user)
+{
+    SHIM_LOG_ENTER("shim_async");
+
+    return submit_write_single(async, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, value,
+                               callback, user);
+}
+
+int
+shim_async_write_bits(shim_async_t *async, int addr, int nb, const uint8_t *src,
+                      shim_async_callback_t callback, void *user)
+{
+    uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+    int nb_bytes = (nb / 8) + ((nb % 8) ? 1 : 0);
+
+    SHIM_LOG_ENTER("shim_async");
+
+    if(nb < 1 || nb > MODBUS_MAX_WRITE_BITS) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = MODBUS_FC_WRITE_MULTIPLE_COILS;
+    MODBUS_SET_INT16_TO_INT8(pdu, 1, addr);
+    MODBUS_SET_INT16_TO_INT8(pdu, 3, nb);
+    pdu[5] = nb_bytes;
+    for(int i = 0; i < nb_bytes; i++) {
+        pdu[6 + i] = modbus_get_byte_from_bits(src, i * 8,
+            (nb - (i * 8)) < 8 ? nb - (i * 8) : 8);
+    }
+
+    return submit(async, addr, nb, pdu, 6 + nb_bytes, NULL, callback, user);
+}
+
+int
+shim_async_write_registers(shim_async_t *async, int addr, int nb, const uint16_t *src,
+                           shim_async_callback_t callback, void *user)
+{
+    uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+
+    SHIM_LOG_ENTER("shim_async");
+
+    if(nb < 1 || nb > MODBUS_MAX_WRITE_REGISTERS) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+    MODBUS_SET_INT16_TO_INT8(pdu, 1, addr);
+    MODBUS_SET_INT16_TO_INT8(pdu, 3, nb);
+    pdu[5] = nb * 2;
+    for(int i = 0; i < nb; i++) {
+        MODBUS_SET_INT16_TO_INT8(pdu, 6 + (i * 2), src[i]);
+    }
+
+    return submit(async, addr, nb, pdu, 6 + (nb * 2), NULL, callback, user);
+}
+
+int
+shim_async_poll(shim_async_t *async)
+{
+    uint8_t rsp[TCP_FRAME_MAX_LENGTH];
+    shim_transaction_t *transaction;
+    int rc;
+
+    if(async->nb_pending == 0) {
+        return 0;
+    }
+
+    rc = tcp_frame_receive_adu(async->ctx, rsp);
+    if(rc == -1) {
+        fail_all(async, errno);
+        return -1;
+    }
+
+    /* a response to no pending request: the connection is out of step */
+    transaction = find_transaction(async, MODBUS_GET_INT16_FROM_INT8(rsp, 0));
+    if(transaction == NULL) {
+        SHIM_LOG_DEBUG("> response to an unknown transaction");
+        fail_all(async, EMBBADDATA);
+        return -1;
+    }
+
+    rc = tcp_frame_check_response(rsp, rc, MBAP_HEADER_LENGTH,
+                                  transaction->transaction_id, transaction->function);
+    if(rc != -1) {
+        rc = decode_response(transaction, rsp, rc);
+    }
+    complete(async, transaction, rc, (rc == -1) ? errno : 0);
+
+    return async->nb_pending;
+}
+
+int
+shim_async_flush(shim_async_t *async)
+{
+    while(async->nb_pending > 0) {
+        if(shim_async_poll(async) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "shim_log.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/* Ring buffer geometry; SHIM_LOG_SLOTS must be a power of two */
+#define SHIM_LOG_SLOTS 1024
+#define SHIM_LOG_MESSAGE_LENGTH 512
+
+/* How long the writer thread sleeps when the ring is empty */
+#define SHIM_LOG_IDLE_MS 1
+
+/**
+ * One message in the ring
+ *
+ * sequence implements a bounded multi-producer queue: a producer owns the
+ * slot when sequence == its ticket, and publishes it by setting
+ * sequence = ticket + 1; the writer then releases it for the next lap.
+ * */
+typedef struct {
+    std::atomic<size_t> sequence;
+    int level;
+    int length;
+    char message[SHIM_LOG_MESSAGE_LENGTH];
+} log_slot_t;
+
+static log_slot_t ring_[SHIM_LOG_SLOTS];
+static std::atomic<size_t> head_(0);       /* next ticket handed to a producer */
+static size_t tail_ = 0;                   /* next slot to write out, under drain_mutex_ */
+static std::atomic<uint64_t> dropped_(0);
+static std::mutex drain_mutex_;
+static std::once_flag started_;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/* Write out published messages in order; returns the number written */
+static int
+drain(void)
+{
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    int written = 0;
+
+    for(;;) {
+        log_slot_t *slot = &ring_[tail_ & (SHIM_LOG_SLOTS - 1)];
+
+        if(slot->sequence.load(std::memory_order_acquire) != tail_ + 1) {
+            break;
+        }
+
+        fwrite(slot->message, 1, slot->length,
+               (slot->level == SHIM_LOG_LEVEL_ERROR) ? stderr : stdout);
+
+        slot->sequence.store(tail_ + SHIM_LOG_SLOTS, std::memory_order_release);
+        tail_++;
+        written++;
+    }
+
+    if(written) {
+        fflush(stdout);
+    }
+
+    return written;
+}
+
+static void
+writer_thread(void)
+{
+    for(;;) {
+        if(drain() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(SHIM_LOG_IDLE_MS));
+        }
+    }
+}
+
+static void
+start(void)
+{
+    for(size_t i = 0; i < SHIM_LOG_SLOTS; i++) {
+        ring_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    std::thread(writer_thread).detach();
+    atexit(shim_log_flush);
+}
+
+/******************
+ * LOG FUNCTIONS
+ *****************/
+
+void
+shim_log_write(int level, const char *format, ...)
+{
+    va_list args;
+    log_slot_t *slot;
+    size_t ticket;
+    int length;
+
+    std::call_once(started_, start);
+
+    /* claim a slot, or drop the message if the writer has fallen a lap behind */
+    ticket = head_.load(std::memory_order_relaxed);
+    for(;;) {
+        slot = &ring_[ticket & (SHIM_LOG_SLOTS - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+
+        if(sequence == ticket) {
+            if(head_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(sequence < ticket) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            ticket = head_.load(std::memory_order_relaxed);
+        }
+    }
+
+    va_start(args, format);
+    length = vsnprintf(slot->message, SHIM_LOG_MESSAGE_LENGTH - 1, format, args);
+    va_end(args);
+
+    if(length < 0) {
+        length = 0;
+    } else if(length > SHIM_LOG_MESSAGE_LENGTH - 2) {
+        length = SHIM_LOG_MESSAGE_LENGTH - 2;
+    }
+    slot->message[length++] = '\n';
+    slot->length = length;
+    slot->level = level;
+
+    slot->sequence.store(ticket + 1, std::memory_order_release);
+}
+
+void
+shim_log_flush(void)
+{
+    drain();
+}
+
+uint64_t
+shim_log_dropped(void)
+{
+    return dropped_.load(std::memory_order_relaxed);
+}
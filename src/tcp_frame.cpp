@@ -0,0 +1,422 @@
+#include "tcp_frame.hpp"
+
+#include <atomic>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+/* For MinGW */
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Transaction ids for authenticated requests
+ *
+ * These are independent of the ids libmodbus uses for plain requests on
+ * the same ctx; each response is matched against the id of its request.
+ * */
+static std::atomic<uint16_t> transaction_id_(0);
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/* Write the MBAP header for a new transaction carrying length bytes of PDU */
+static uint16_t
+write_mbap_header(modbus_t *ctx, uint8_t *adu, int pdu_length)
+{
+    uint16_t tid = transaction_id_.fetch_add(1, std::memory_order_relaxed);
+
+    /* the length counts everything after it, unit id included */
+    MODBUS_SET_INT16_TO_INT8(adu, 0, tid);
+    adu[2] = 0;
+    adu[3] = 0;
+    MODBUS_SET_INT16_TO_INT8(adu, MBAP_LENGTH_OFFSET, 1 + pdu_length);
+    adu[MBAP_PREFIX_LENGTH] = tcp_frame_unit_id(ctx);
+
+    return tid;
+}
+
+static int
+send_all(int s, const uint8_t *data, int length)
+{
+    int rc;
+
+    for(int sent = 0; sent < length; sent += rc) {
+        rc = send(s, data + sent, length - sent, MSG_NOSIGNAL);
+        if(rc == -1) {
+            if(errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return length;
+}
+
+/* Remove removed bytes after the header of req, fixing the MBAP length */
+static int
+remove_prefix(uint8_t *req, int req_length, int offset, int removed)
+{
+    memmove(req + offset, req + offset + removed, req_length - offset - removed);
+    req_length -= removed;
+
+    MODBUS_SET_INT16_TO_INT8(req, MBAP_LENGTH_OFFSET, req_length - MBAP_PREFIX_LENGTH);
+
+    return req_length;
+}
+
+/* Receive exactly length bytes, waiting at most the ctx response timeout for each */
+static int
+receive_all(modbus_t *ctx, uint8_t *data, int length)
+{
+    int s = modbus_get_socket(ctx);
+    uint32_t to_sec;
+    uint32_t to_usec;
+    struct timeval tv;
+    fd_set rset;
+    int rc;
+
+    modbus_get_response_timeout(ctx, &to_sec, &to_usec);
+
+    for(int received = 0; received < length; received += rc) {
+        FD_ZERO(&rset);
+        FD_SET(s, &rset);
+        tv.tv_sec = to_sec;
+        tv.tv_usec = to_usec;
+
+        rc = select(s + 1, &rset, NULL, NULL, &tv);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(rc == -1) {
+            if(errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            return -1;
+        }
+
+        rc = recv(s, data + received, length - received, 0);
+        if(rc == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if(rc == -1) {
+            if(errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return length;
+}
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+
+int
+tcp_frame_check_response(const uint8_t *rsp, int rsp_length, int offset,
+                         int transaction_id, int function)
+{
+    if(rsp_length < offset + 2 || MODBUS_GET_INT16_FROM_INT8(rsp, 0) != transaction_id) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    if(rsp[offset] == (function | 0x80) || rsp[offset] == (MODBUS_FC_AUTHENTICATED | 0x80) ||
+       rsp[offset] == (MODBUS_FC_SESSION | 0x80) || rsp[offset] == (MODBUS_FC_HANDLE | 0x80)) {
+        errno = MODBUS_ENOBASE + rsp[offset + 1];
+        return -1;
+    }
+
+    if(rsp[offset] != function) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return rsp_length;
+}
+
+int
+tcp_frame_send_authenticated(modbus_t *ctx,
+                             const uint8_t *token, int token_length,
+                             const uint8_t *pdu, int pdu_length)
+{
+    uint8_t adu[TCP_FRAME_MAX_LENGTH];
+    int length = 0;
+    uint16_t tid;
+
+    if(token_length < 0 || token_length > MODBUS_MAX_STRING_LENGTH ||
+       pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    tid = write_mbap_header(ctx, adu, AUTHENTICATED_PREFIX_LENGTH + token_length + pdu_length);
+    length = MBAP_HEADER_LENGTH;
+
+    adu[length++] = MODBUS_FC_AUTHENTICATED;
+    MODBUS_SET_INT16_TO_INT8(adu, length, token_length);
+    length += 2;
+
+    memcpy(adu + length, token, token_length);
+    length += token_length;
+    memcpy(adu + length, pdu, pdu_length);
+    length += pdu_length;
+
+    if(send_all(modbus_get_socket(ctx), adu, length) == -1) {
+        return -1;
+    }
+
+    return tid;
+}
+
+int
+tcp_frame_send_session(modbus_t *ctx, uint32_t sequence,
+                       const uint8_t mac[SESSION_MAC_LENGTH],
+                       const uint8_t *pdu, int pdu_length)
+{
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH + SESSION_PREFIX_LENGTH];
+    int length;
+    uint16_t tid;
+
+    if(pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    tid = write_mbap_header(ctx, adu, SESSION_PREFIX_LENGTH + pdu_length);
+    length = MBAP_HEADER_LENGTH;
+
+    adu[length++] = MODBUS_FC_SESSION;
+    MODBUS_SET_INT32_TO_INT8(adu, length, sequence);
+    length += 4;
+    memcpy(adu + length, mac, SESSION_MAC_LENGTH);
+    length += SESSION_MAC_LENGTH;
+    memcpy(adu + length, pdu, pdu_length);
+    length += pdu_length;
+
+    if(send_all(modbus_get_socket(ctx), adu, length) == -1) {
+        return -1;
+    }
+
+    return tid;
+}
+
+int
+tcp_frame_send_handle(modbus_t *ctx, uint32_t handle,
+                      const uint8_t *pdu, int pdu_length)
+{
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH + HANDLE_PREFIX_LENGTH];
+    uint16_t tid;
+
+    if(pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    tid = write_mbap_header(ctx, adu, HANDLE_PREFIX_LENGTH + pdu_length);
+    adu[MBAP_HEADER_LENGTH] = MODBUS_FC_HANDLE;
+    MODBUS_SET_INT32_TO_INT8(adu, MBAP_HEADER_LENGTH + 1, handle);
+    memcpy(adu + MBAP_HEADER_LENGTH + HANDLE_PREFIX_LENGTH, pdu, pdu_length);
+
+    if(send_all(modbus_get_socket(ctx), adu,
+                MBAP_HEADER_LENGTH + HANDLE_PREFIX_LENGTH + pdu_length) == -1) {
+        return -1;
+    }
+
+    return tid;
+}
+
+uint8_t
+tcp_frame_unit_id(modbus_t *ctx)
+{
+    int slave = modbus_get_slave(ctx);
+
+    return (slave == -1) ? MODBUS_TCP_SLAVE : slave;
+}
+
+int
+tcp_frame_send(modbus_t *ctx, const uint8_t *pdu, int pdu_length)
+{
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint16_t tid;
+
+    if(pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    tid = write_mbap_header(ctx, adu, pdu_length);
+    memcpy(adu + MBAP_HEADER_LENGTH, pdu, pdu_length);
+
+    if(send_all(modbus_get_socket(ctx), adu, MBAP_HEADER_LENGTH + pdu_length) == -1) {
+        return -1;
+    }
+
+    return tid;
+}
+
+int
+tcp_frame_receive_adu(modbus_t *ctx, uint8_t *rsp)
+{
+    int length;
+
+    if(receive_all(ctx, rsp, MBAP_HEADER_LENGTH) == -1) {
+        return -1;
+    }
+
+    /* the MBAP length counts the unit id, already received */
+    length = MODBUS_GET_INT16_FROM_INT8(rsp, MBAP_LENGTH_OFFSET);
+    if(length < 2 || MBAP_PREFIX_LENGTH + length > TCP_FRAME_MAX_LENGTH) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    if(receive_all(ctx, rsp + MBAP_HEADER_LENGTH, length - 1) == -1) {
+        return -1;
+    }
+
+    return MBAP_PREFIX_LENGTH + length;
+}
+
+int
+tcp_frame_receive_raw(modbus_t *ctx, int transaction_id, int function, uint8_t *rsp)
+{
+    int rc;
+
+    rc = tcp_frame_receive_adu(ctx, rsp);
+    if(rc == -1) {
+        return -1;
+    }
+
+    return tcp_frame_check_response(rsp, rc, MBAP_HEADER_LENGTH, transaction_id, function);
+}
+
+int
+tcp_frame_receive(modbus_t *ctx, int transaction_id, int function, uint8_t *rsp)
+{
+    int offset = modbus_get_header_length(ctx);
+    int rc;
+
+    rc = modbus_receive_confirmation(ctx, rsp);
+    if(rc == -1) {
+        return -1;
+    }
+
+    return tcp_frame_check_response(rsp, rc, offset, transaction_id, function);
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+bool
+tcp_frame_parse_authenticated(const uint8_t *req, int req_length, int offset,
+                              const uint8_t **token, int *token_length)
+{
+    int length;
+
+    if(req_length < offset + AUTHENTICATED_PREFIX_LENGTH ||
+       req[offset] != MODBUS_FC_AUTHENTICATED) {
+        return false;
+    }
+
+    length = MODBUS_GET_INT16_FROM_INT8(req, offset + 1);
+
+    /* the token must be followed by at least a function code, and a whole PDU at most */
+    if(length > MODBUS_MAX_STRING_LENGTH ||
+       offset + AUTHENTICATED_PREFIX_LENGTH + length >= req_length ||
+       req_length - offset - AUTHENTICATED_PREFIX_LENGTH - length > MODBUS_MAX_PDU_LENGTH) {
+        return false;
+    }
+
+    *token = req + offset + AUTHENTICATED_PREFIX_LENGTH;
+    *token_length = length;
+
+    return true;
+}
+
+bool
+tcp_frame_parse_session(const uint8_t *req, int req_length, int offset,
+                        uint32_t *sequence, const uint8_t **mac)
+{
+    /* the MAC must be followed by at least a function code, and a whole PDU at most */
+    if(req_length <= offset + SESSION_PREFIX_LENGTH ||
+       req_length - offset - SESSION_PREFIX_LENGTH > MODBUS_MAX_PDU_LENGTH ||
+       req[offset] != MODBUS_FC_SESSION) {
+        return false;
+    }
+
+    *sequence = (uint32_t)MODBUS_GET_INT32_FROM_INT8(req, offset + 1);
+    *mac = req + offset + 5;
+
+    return true;
+}
+
+bool
+tcp_frame_parse_handle(const uint8_t *req, int req_length, int offset, uint32_t *handle)
+{
+    /* the handle must be followed by at least a function code, and a whole PDU at most */
+    if(req_length <= offset + HANDLE_PREFIX_LENGTH ||
+       req_length - offset - HANDLE_PREFIX_LENGTH > MODBUS_MAX_PDU_LENGTH ||
+       req[offset] != MODBUS_FC_HANDLE) {
+        return false;
+    }
+
+    *handle = (uint32_t)MODBUS_GET_INT32_FROM_INT8(req, offset + 1);
+
+    return true;
+}
+
+int
+tcp_frame_build_response(const uint8_t *req, int offset,
+                         const uint8_t *pdu, int pdu_length, uint8_t *rsp)
+{
+    /* same transaction, protocol and unit ids */
+    memcpy(rsp, req, offset);
+    MODBUS_SET_INT16_TO_INT8(rsp, MBAP_LENGTH_OFFSET, 1 + pdu_length);
+    memcpy(rsp + offset, pdu, pdu_length);
+
+    return offset + pdu_length;
+}
+
+int
+tcp_frame_build_exception(const uint8_t *req, int offset, int function,
+                          int exception_code, uint8_t *rsp)
+{
+    uint8_t pdu[2];
+
+    pdu[0] = function | 0x80;
+    pdu[1] = exception_code;
+
+    return tcp_frame_build_response(req, offset, pdu, sizeof(pdu), rsp);
+}
+
+int
+tcp_frame_unwrap_authenticated(uint8_t *req, int req_length, int offset,
+                               int token_length)
+{
+    return remove_prefix(req, req_length, offset, AUTHENTICATED_PREFIX_LENGTH + token_length);
+}
+
+int
+tcp_frame_unwrap_session(uint8_t *req, int req_length, int offset)
+{
+    return remove_prefix(req, req_length, offset, SESSION_PREFIX_LENGTH);
+}
+
+int
+tcp_frame_unwrap_handle(uint8_t *req, int req_length, int offset)
+{
+    return remove_prefix(req, req_length, offset, HANDLE_PREFIX_LENGTH);
+}
@@ -0,0 +1,528 @@
+/*
+ * Unit tests for the server's token handling, without a Modbus
+ * connection: the allocation-free Macaroon parser (macaroon_view.hpp),
+ * checked against libmacaroons, the admission filter (token_filter.hpp),
+ * the binary caveat encoding (caveats.hpp) and the software capabilities
+ * the CHERI shim checks table accesses against (cheri_portable.h).
+ *
+ * Returns 0 if every test passes.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+/* Macaroons */
+#include "macaroons/macaroons.hpp"
+
+/* shim support */
+#include "macaroon_view.hpp"
+#include "caveats.hpp"
+#include "hmac_sha256.hpp"
+#include "token_filter.hpp"
+#include "cheri_portable.h"
+
+// ignore variadic arguments from the ASSERT_TRUE macro
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wgnu-zero-variadic-macro-arguments"
+
+#define BUG_REPORT(_cond, _format, ...) \
+    printf("\nLine %d: assertion error for '%s': " _format "\n", __LINE__, #_cond, ##__VA_ARGS__)
+
+#define ASSERT_TRUE(_cond, _format, ...) {  \
+    if (_cond) {                                  \
+        printf("OK\n");                           \
+    } else {                                      \
+        BUG_REPORT(_cond, _format, ##__VA_ARGS__);    \
+        goto close;                               \
+    }                                             \
+};
+
+static const std::string location = "https://www.modbus.com/macaroons/";
+static const std::string key = "a bad secret";
+static const std::string identifier = "id for a bad secret";
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/* A V1 packet: 4 hex digit length (of the whole packet), key, ' ', value, '\n' */
+static std::string
+v1_packet(const std::string &packet_key, const std::string &value)
+{
+    char prefix[5];
+
+    snprintf(prefix, sizeof(prefix), "%04zx", 4 + packet_key.size() + 1 + value.size() + 1);
+    return prefix + packet_key + " " + value + "\n";
+}
+
+/* URL-safe base64, without padding, as libmacaroons serialises */
+static std::string
+base64_encode(const std::string &data)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    std::string encoded;
+    uint32_t bits = 0;
+    int nb_bits = 0;
+
+    for(unsigned char c : data) {
+        bits = (bits << 8) | c;
+        nb_bits += 8;
+        while(nb_bits >= 6) {
+            nb_bits -= 6;
+            encoded += digits[(bits >> nb_bits) & 0x3F];
+        }
+    }
+    if(nb_bits > 0) {
+        encoded += digits[(bits << (6 - nb_bits)) & 0x3F];
+    }
+
+    return encoded;
+}
+
+/**
+ * The signature libmacaroons gives a Macaroon made with key and id and
+ * carrying caveats: the key is derived under a fixed generator key, then
+ * each caveat is chained on.
+ * */
+static std::string
+chain_signature(const std::string &chain_key, const std::string &id,
+                const std::vector<std::string> &caveats)
+{
+    uint8_t generator[HMAC_SHA256_LENGTH] = {0};
+    uint8_t derived[HMAC_SHA256_LENGTH];
+    uint8_t signature[HMAC_SHA256_LENGTH];
+
+    memcpy(generator, "macaroons-key-generator", strlen("macaroons-key-generator"));
+    hmac_sha256(generator, sizeof(generator),
+                (const uint8_t *)chain_key.data(), chain_key.size(), derived);
+    hmac_sha256(derived, sizeof(derived), (const uint8_t *)id.data(), id.size(), signature);
+
+    for(const std::string &caveat : caveats) {
+        hmac_sha256(signature, sizeof(signature),
+                    (const uint8_t *)caveat.data(), caveat.size(), signature);
+    }
+
+    return std::string((const char *)signature, HMAC_SHA256_LENGTH);
+}
+
+/* The decoded V1 packets of a Macaroon carrying caveats, signed with key */
+static std::string
+v1_packets(const std::vector<std::string> &caveats)
+{
+    std::string packets = v1_packet("location", location) + v1_packet("identifier", identifier);
+
+    for(const std::string &caveat : caveats) {
+        packets += v1_packet("cid", caveat);
+    }
+
+    return packets + v1_packet("signature", chain_signature(key, identifier, caveats));
+}
+
+static std::vector<std::string>
+numbered_caveats(int nb_caveats)
+{
+    std::vector<std::string> caveats;
+
+    for(int i = 0; i < nb_caveats; i++) {
+        caveats.push_back(create_address_caveat(i, 100 + i));
+    }
+
+    return caveats;
+}
+
+static macaroon_view_result_t
+parse(macaroon_view_t *view, const std::string &token)
+{
+    return macaroon_view_parse(view, (const uint8_t *)token.data(), token.size());
+}
+
+static bool
+equal_view(const byte_view_t &field, const std::string &value)
+{
+    return field.length == value.size() && memcmp(field.data, value.data(), field.length) == 0;
+}
+
+/* libmacaroons gives the signature either raw or hex encoded */
+static std::string
+signature_bytes(const std::string &signature)
+{
+    std::string bytes;
+    unsigned int byte;
+
+    if(signature.size() != 2 * HMAC_SHA256_LENGTH) {
+        return signature;
+    }
+
+    for(int i = 0; i < HMAC_SHA256_LENGTH; i++) {
+        sscanf(signature.c_str() + 2 * i, "%2x", &byte);
+        bytes += (char)byte;
+    }
+
+    return bytes;
+}
+
+/* Verify view natively, as the server's fast path does */
+static bool
+verify_native(const macaroon_view_t *view, const std::string &chain_key)
+{
+    std::vector<std::string> caveats;
+    std::string signature;
+
+    for(int i = 0; i < view->nb_caveats; i++) {
+        caveats.push_back(std::string(view->caveats[i].data, view->caveats[i].length));
+    }
+
+    signature = chain_signature(chain_key,
+                                std::string(view->identifier.data, view->identifier.length),
+                                caveats);
+
+    return hmac_sha256_equal((const uint8_t *)signature.data(), view->signature);
+}
+
+/* Verify token with libmacaroons, satisfying each of its caveats */
+static bool
+verify_libmacaroons(const std::string &token, const std::string &chain_key)
+{
+    macaroons::Macaroon M;
+    macaroons::Verifier V;
+
+    try {
+        M = macaroons::Macaroon::deserialize(token);
+    } catch(macaroons::exception::Invalid &e) {
+        return false;
+    }
+
+    for(const std::string &caveat : M.first_party_caveats()) {
+        V.satisfy_exact(caveat);
+    }
+
+    return V.verify_unsafe(M, chain_key);
+}
+
+/* Compile the single caveat */
+static bool
+compile_caveat(compiled_caveats_t *caveats, const std::string &caveat)
+{
+    compiled_caveats_init(caveats);
+    return compiled_caveats_add(caveats, caveat.data(), caveat.size());
+}
+
+/******************
+ * TESTS
+ *****************/
+
+static int
+test_macaroon_view(void)
+{
+    static macaroon_view_t view;
+    std::vector<std::string> caveats;
+    std::string packets;
+    macaroon_view_result_t rc;
+
+    printf("\nTEST MACAROON VIEW:\n");
+
+    printf("1/10 macaroon_view_parse (0 caveats): ");
+    rc = parse(&view, base64_encode(v1_packets({})));
+    ASSERT_TRUE(rc == MACAROON_VIEW_OK && view.nb_caveats == 0 &&
+                equal_view(view.location, location) &&
+                equal_view(view.identifier, identifier) &&
+                verify_native(&view, key), "rc %d, %d caveats", rc, view.nb_caveats);
+
+    printf("2/10 macaroon_view_parse (1 caveat): ");
+    caveats = {create_function_caveat(MODBUS_FC_READ_HOLDING_REGISTERS)};
+    rc = parse(&view, base64_encode(v1_packets(caveats)));
+    ASSERT_TRUE(rc == MACAROON_VIEW_OK && view.nb_caveats == 1 &&
+                equal_view(view.caveats[0], caveats[0]) &&
+                verify_native(&view, key), "rc %d, %d caveats", rc, view.nb_caveats);
+
+    printf("3/10 macaroon_view_parse (%d caveats): ", MACAROON_VIEW_MAX_CAVEATS);
+    caveats = numbered_caveats(MACAROON_VIEW_MAX_CAVEATS);
+    rc = parse(&view, base64_encode(v1_packets(caveats)));
+    ASSERT_TRUE(rc == MACAROON_VIEW_OK && view.nb_caveats == MACAROON_VIEW_MAX_CAVEATS &&
+                equal_view(view.caveats[MACAROON_VIEW_MAX_CAVEATS - 1],
+                           caveats[MACAROON_VIEW_MAX_CAVEATS - 1]) &&
+                verify_native(&view, key), "rc %d, %d caveats", rc, view.nb_caveats);
+
+    printf("4/10 macaroon_view_parse (%d caveats): ", MACAROON_VIEW_MAX_CAVEATS + 1);
+    rc = parse(&view, base64_encode(v1_packets(numbered_caveats(MACAROON_VIEW_MAX_CAVEATS + 1))));
+    ASSERT_TRUE(rc == MACAROON_VIEW_INVALID, "rc %d", rc);
+
+    printf("5/10 macaroon_view_parse (truncated packet): ");
+    packets = v1_packets({});
+    rc = parse(&view, base64_encode(packets.substr(0, packets.size() - 5)));
+    ASSERT_TRUE(rc == MACAROON_VIEW_INVALID, "rc %d", rc);
+
+    printf("6/10 macaroon_view_parse (bad hex length): ");
+    packets = v1_packets({});
+    packets.replace(0, 4, "00x9");
+    rc = parse(&view, base64_encode(packets));
+    ASSERT_TRUE(rc == MACAROON_VIEW_INVALID, "rc %d", rc);
+
+    printf("7/10 macaroon_view_parse (trailing bytes after signature): ");
+    rc = parse(&view, base64_encode(v1_packets({}) + "0006x\n"));
+    ASSERT_TRUE(rc == MACAROON_VIEW_INVALID, "rc %d", rc);
+
+    printf("8/10 macaroon_view_parse (third party caveat): ");
+    packets = v1_packet("location", location) + v1_packet("identifier", identifier) +
+              v1_packet("cid", "third party id") +
+              v1_packet("vid", std::string(56, 'v')) +
+              v1_packet("cl", "https://third.party/") +
+              v1_packet("signature", std::string(HMAC_SHA256_LENGTH, 's'));
+    rc = parse(&view, base64_encode(packets));
+    ASSERT_TRUE(rc == MACAROON_VIEW_UNSUPPORTED, "rc %d", rc);
+
+    printf("9/10 macaroon_view_parse (V2): ");
+    rc = parse(&view, base64_encode("\x02" + v1_packets({})));
+    ASSERT_TRUE(rc == MACAROON_VIEW_UNSUPPORTED, "rc %d", rc);
+
+    printf("10/10 macaroon_view_parse (not base64): ");
+    rc = parse(&view, "!" + base64_encode(v1_packets({})).substr(1));
+    ASSERT_TRUE(rc == MACAROON_VIEW_INVALID, "rc %d", rc);
+
+    return 0;
+
+close:
+    return -1;
+}
+
+/**
+ * The native path (macaroon_view_parse() and the HMAC chain) and
+ * libmacaroons must agree on every token: on its fields, and on whether
+ * it verifies
+ * */
+static int
+test_native_libmacaroons(void)
+{
+    static macaroon_view_t view;
+    std::vector<int> nb_caveats = {0, 1, MACAROON_VIEW_MAX_CAVEATS};
+    std::vector<std::string> caveats;
+    std::string token;
+    std::string packets;
+    macaroon_view_result_t rc;
+    bool agree;
+
+    printf("\nTEST NATIVE AND LIBMACAROONS AGREE:\n");
+
+    for(size_t n = 0; n < nb_caveats.size(); n++) {
+        macaroons::Macaroon M{location, key, identifier};
+
+        caveats = numbered_caveats(nb_caveats[n]);
+        for(const std::string &caveat : caveats) {
+            M = M.add_first_party_caveat(caveat);
+        }
+        token = M.serialize();
+
+        printf("%zu/5 libmacaroons token (%d caveats), fields: ", n + 1, nb_caveats[n]);
+        rc = parse(&view, token);
+        agree = rc == MACAROON_VIEW_OK &&
+                view.nb_caveats == (int)M.first_party_caveats().size() &&
+                equal_view(view.location, location) &&
+                equal_view(view.identifier, identifier) &&
+                memcmp(view.signature, signature_bytes(M.signature()).data(), HMAC_SHA256_LENGTH) == 0;
+        for(int i = 0; agree && i < view.nb_caveats; i++) {
+            agree = equal_view(view.caveats[i], M.first_party_caveats()[i]);
+        }
+        ASSERT_TRUE(agree, "rc %d, %d caveats", rc, view.nb_caveats);
+
+        printf("%zu/5 libmacaroons token (%d caveats), verification: ", n + 1, nb_caveats[n]);
+        ASSERT_TRUE(verify_native(&view, key) && verify_libmacaroons(token, key) &&
+                    !verify_native(&view, "another secret") &&
+                    !verify_libmacaroons(token, "another secret"), "");
+    }
+
+    printf("4/5 native token, verification: ");
+    caveats = {create_function_caveat(MODBUS_FC_WRITE_SINGLE_REGISTER),
+               create_address_caveat(0, 10)};
+    token = base64_encode(v1_packets(caveats));
+    rc = parse(&view, token);
+    ASSERT_TRUE(rc == MACAROON_VIEW_OK && verify_native(&view, key) &&
+                verify_libmacaroons(token, key), "rc %d", rc);
+
+    printf("5/5 tampered token, verification: ");
+    packets = v1_packets(caveats);
+    packets[packets.find("cid ") + 4] ^= 0x03;
+    token = base64_encode(packets);
+    rc = parse(&view, token);
+    ASSERT_TRUE(rc == MACAROON_VIEW_OK && !verify_native(&view, key) &&
+                !verify_libmacaroons(token, key), "rc %d", rc);
+
+    return 0;
+
+close:
+    return -1;
+}
+
+/* Each stage of the admission filter, in the order it runs */
+static int
+test_token_filter(void)
+{
+    std::string token = base64_encode(v1_packets({}));
+    std::string bad;
+    token_filter_result_t rc;
+    uint64_t hash;
+
+    printf("\nTEST TOKEN FILTER:\n");
+
+    token_filter_clear();
+
+    printf("1/7 token_filter_check (valid token): ");
+    rc = token_filter_check((const uint8_t *)token.data(), token.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_PASS && hash != 0, "%s", get_token_filter_name(rc));
+
+    printf("2/7 token_filter_check (too short): ");
+    bad = token.substr(0, TOKEN_FILTER_MIN_LENGTH - 1);
+    rc = token_filter_check((const uint8_t *)bad.data(), bad.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_LENGTH, "%s", get_token_filter_name(rc));
+
+    printf("3/7 token_filter_check (too long): ");
+    bad = std::string(TOKEN_FILTER_MAX_LENGTH + 1, 'A');
+    rc = token_filter_check((const uint8_t *)bad.data(), bad.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_LENGTH, "%s", get_token_filter_name(rc));
+
+    printf("4/7 token_filter_check (no V1 packet length): ");
+    bad = "AAAA" + token.substr(4);
+    rc = token_filter_check((const uint8_t *)bad.data(), bad.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_STRUCTURE, "%s", get_token_filter_name(rc));
+
+    printf("5/7 token_filter_check (not base64): ");
+    bad = token;
+    bad[bad.size() / 2] = '!';
+    rc = token_filter_check((const uint8_t *)bad.data(), bad.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_ALPHABET, "%s", get_token_filter_name(rc));
+
+    printf("6/7 token_filter_check (rejected token): ");
+    rc = token_filter_check((const uint8_t *)token.data(), token.size(), &hash);
+    token_filter_reject(hash);
+    rc = token_filter_check((const uint8_t *)token.data(), token.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_RECENTLY_REJECTED, "%s", get_token_filter_name(rc));
+
+    printf("7/7 token_filter_check (rejected token, after token_filter_clear): ");
+    token_filter_clear();
+    rc = token_filter_check((const uint8_t *)token.data(), token.size(), &hash);
+    ASSERT_TRUE(rc == TOKEN_FILTER_PASS, "%s", get_token_filter_name(rc));
+
+    return 0;
+
+close:
+    return -1;
+}
+
+/**
+ * Binary caveats: each value is a varint, which must be well-formed,
+ * in range and as short as possible
+ * */
+static int
+test_binary_caveats(void)
+{
+    compiled_caveats_t caveats;
+    std::string function;
+    std::string address;
+
+    printf("\nTEST BINARY CAVEATS:\n");
+
+    /* a request is only authorised with both a function and an address caveat */
+    printf("1/9 create_function_caveat, create_address_caveat round trip: ");
+    function = create_function_caveat(std::vector<int>{MODBUS_FC_READ_HOLDING_REGISTERS, 31});
+    address = create_address_caveat(100, 0xFFFF);
+    compiled_caveats_init(&caveats);
+    ASSERT_TRUE(compiled_caveats_add(&caveats, function.data(), function.size()) &&
+                compiled_caveats_add(&caveats, address.data(), address.size()) &&
+                check_caveats(&caveats, MODBUS_FC_READ_HOLDING_REGISTERS, 100, 10) == CAVEAT_PASS, "");
+
+    printf("2/9 check_caveats outside the caveats: ");
+    ASSERT_TRUE(check_caveats(&caveats, MODBUS_FC_WRITE_SINGLE_REGISTER, 100, 1) == CAVEAT_FAIL_FUNCTION &&
+                check_caveats(&caveats, MODBUS_FC_READ_HOLDING_REGISTERS, 99, 10) == CAVEAT_FAIL_ADDRESS, "");
+
+    printf("3/9 varint of the largest value: ");
+    ASSERT_TRUE(compile_caveat(&caveats, std::string("\x01\x80\x80\x80\x80\x10", 6)), "");
+
+    printf("4/9 varint out of range: ");
+    ASSERT_TRUE(!compile_caveat(&caveats, std::string("\x01\x81\x80\x80\x80\x10", 6)), "");
+
+    printf("5/9 varint ending in a zero byte: ");
+    ASSERT_TRUE(!compile_caveat(&caveats, std::string("\x01\x81\x00", 3)) &&
+                !compile_caveat(&caveats, std::string("\x01\x82\x80\x00", 4)), "");
+
+    printf("6/9 varint of zero: ");
+    ASSERT_TRUE(!compile_caveat(&caveats, std::string("\x01\x00", 2)) &&
+                !compile_caveat(&caveats, std::string("\x01\x80\x00", 3)), "");
+
+    printf("7/9 truncated varint: ");
+    ASSERT_TRUE(!compile_caveat(&caveats, std::string("\x01\x81", 2)) &&
+                !compile_caveat(&caveats, std::string("\x01", 1)), "");
+
+    printf("8/9 trailing bytes after varint: ");
+    ASSERT_TRUE(!compile_caveat(&caveats, std::string("\x01\x02\x02", 3)), "");
+
+    printf("9/9 address varint ending in a zero byte: ");
+    ASSERT_TRUE(compile_caveat(&caveats, std::string("\x02\x01\x01", 3)) &&
+                !compile_caveat(&caveats, std::string("\x02\x01\x81\x00", 4)), "");
+
+    return 0;
+
+close:
+    return -1;
+}
+
+/**
+ * Software capabilities: an access is only allowed with every permission
+ * it needs, and entirely within the bounds
+ * */
+static int
+test_soft_capabilities(void)
+{
+    uint16_t registers[16] = {0};
+    cheri_soft_cap_t cap = cheri_soft_cap_new(registers, sizeof(registers), CHERI_PERM_LOAD);
+
+    printf("\nTEST SOFTWARE CAPABILITIES:\n");
+
+#if CHERI_SOFT_CHECKS
+    printf("1/4 load within bounds: ");
+    ASSERT_TRUE(cheri_soft_cap_check(&cap, registers, sizeof(registers), CHERI_PERM_LOAD) &&
+                cheri_soft_cap_check(&cap, &registers[15], sizeof(uint16_t), CHERI_PERM_LOAD), "");
+
+    printf("2/4 store without CHERI_PERM_STORE: ");
+    ASSERT_TRUE(!cheri_soft_cap_check(&cap, registers, sizeof(uint16_t), CHERI_PERM_STORE) &&
+                !cheri_soft_cap_check(&cap, registers, sizeof(uint16_t),
+                                      CHERI_PERM_LOAD | CHERI_PERM_STORE), "");
+
+    printf("3/4 access past the end: ");
+    ASSERT_TRUE(!cheri_soft_cap_check(&cap, &registers[15], 2 * sizeof(uint16_t), CHERI_PERM_LOAD) &&
+                !cheri_soft_cap_check(&cap, registers, sizeof(registers) + 1, CHERI_PERM_LOAD), "");
+
+    printf("4/4 access before the base: ");
+    ASSERT_TRUE(!cheri_soft_cap_check(&cap, (const uint8_t *)registers - 1, 1, CHERI_PERM_LOAD), "");
+#else
+    (void)cap;
+    printf("skipped: checks are made by the hardware, or trusted\n");
+#endif
+
+    return 0;
+
+#if CHERI_SOFT_CHECKS
+close:
+    return -1;
+#endif
+}
+
+int
+main(void)
+{
+    int rc = 0;
+
+    rc |= test_macaroon_view();
+    rc |= test_native_libmacaroons();
+    rc |= test_token_filter();
+    rc |= test_binary_caveats();
+    rc |= test_soft_capabilities();
+
+    printf("\nALL TESTS %s\n", rc == 0 ? "PASS" : "FAIL");
+
+    return rc == 0 ? 0 : 1;
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,168 @@
+#include "token_filter.hpp"
+
+#include <atomic>
+#include <string.h>
+
+/**
+ * Hashes of recently rejected tokens, direct-mapped
+ *
+ * A colliding rejection replaces the previous one.  0 marks an empty
+ * slot, so hashes always have their low bit set.
+ * */
+static std::atomic<uint64_t> rejected_[TOKEN_FILTER_CACHE_SIZE];
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static bool
+is_base64(uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+           c == '+' || c == '/' || c == '-' || c == '_';
+}
+
+/* 1 for every byte that is not a base64 digit, so a whole token is checked without branches */
+static uint8_t not_base64_[256];
+
+static bool
+not_base64_init(void)
+{
+    for(int c = 0; c < 256; c++) {
+        not_base64_[c] = !is_base64((uint8_t)c);
+    }
+
+    return true;
+}
+
+static bool not_base64_ready_ = not_base64_init();
+
+static int
+base64_value(uint8_t c)
+{
+    if(c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if(c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if(c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+
+    return (c == '+' || c == '-') ? 62 : 63;
+}
+
+static bool
+is_hex(uint8_t c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* The first 4 characters (already known to be base64) decode to the start of a hex packet length */
+static bool
+has_v1_prefix(const uint8_t *token)
+{
+    uint32_t bits = (base64_value(token[0]) << 18) | (base64_value(token[1]) << 12) |
+                    (base64_value(token[2]) << 6) | base64_value(token[3]);
+
+    return is_hex(bits >> 16) && is_hex((bits >> 8) & 0xFF) && is_hex(bits & 0xFF);
+}
+
+/* Hash a token 8 bytes at a time; not cryptographic, only to recognise repeats */
+static uint64_t
+token_hash(const uint8_t *token, size_t length)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    uint64_t word;
+    size_t i;
+
+    for(i = 0; i + 8 <= length; i += 8) {
+        memcpy(&word, token + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+
+    word = 0;
+    memcpy(&word, token + i, length - i);
+    hash = (hash ^ word) * 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 29;
+
+    return hash | 1;
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+token_filter_result_t
+token_filter_check(const uint8_t *token, size_t length, uint64_t *hash)
+{
+    size_t data_length = length;
+    uint8_t invalid = 0;
+
+    *hash = 0;
+
+    if(length < TOKEN_FILTER_MIN_LENGTH || length > TOKEN_FILTER_MAX_LENGTH) {
+        return TOKEN_FILTER_LENGTH;
+    }
+
+    /* up to two padding characters */
+    for(int i = 0; i < 2 && token[data_length - 1] == '='; i++) {
+        data_length--;
+    }
+
+    if(!is_base64(token[0]) || !is_base64(token[1]) || !is_base64(token[2]) ||
+       !is_base64(token[3]) || !has_v1_prefix(token)) {
+        return TOKEN_FILTER_STRUCTURE;
+    }
+
+    for(size_t i = 4; i < data_length; i++) {
+        invalid |= not_base64_[token[i]];
+    }
+    if(invalid) {
+        return TOKEN_FILTER_ALPHABET;
+    }
+
+    *hash = token_hash(token, length);
+    if(rejected_[*hash & (TOKEN_FILTER_CACHE_SIZE - 1)].load(std::memory_order_relaxed) == *hash) {
+        return TOKEN_FILTER_RECENTLY_REJECTED;
+    }
+
+    return TOKEN_FILTER_PASS;
+}
+
+void
+token_filter_reject(uint64_t hash)
+{
+    if(hash != 0) {
+        rejected_[hash & (TOKEN_FILTER_CACHE_SIZE - 1)].store(hash, std::memory_order_relaxed);
+    }
+}
+
+void
+token_filter_clear(void)
+{
+    for(int i = 0; i < TOKEN_FILTER_CACHE_SIZE; i++) {
+        rejected_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+const char *
+get_token_filter_name(token_filter_result_t result)
+{
+    switch(result) {
+        case TOKEN_FILTER_PASS:
+            return "PASS";
+        case TOKEN_FILTER_LENGTH:
+            return "LENGTH";
+        case TOKEN_FILTER_STRUCTURE:
+            return "STRUCTURE";
+        case TOKEN_FILTER_ALPHABET:
+            return "ALPHABET";
+        case TOKEN_FILTER_RECENTLY_REJECTED:
+            return "RECENTLY_REJECTED";
+        default:
+            return "UNKNOWN";
+    }
+}
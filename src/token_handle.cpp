@@ -0,0 +1,241 @@
+#include "token_handle.hpp"
+
+#include <mutex>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ENTRY UINT32_MAX
+
+typedef struct alignas(TOKEN_HANDLE_CACHE_LINE) {
+    uint32_t handle;                /* 0 if the entry is free */
+    uint32_t prev;                  /* LRU neighbours, NO_ENTRY at either end */
+    uint32_t next;
+    bool referenced;                /* CLOCK: used since the hand last passed */
+    uint64_t owner;                 /* the connection the handle was issued to */
+    compiled_caveats_t caveats;
+} token_handle_entry_t;
+
+static_assert(sizeof(token_handle_entry_t) == TOKEN_HANDLE_CACHE_LINE,
+              "a token handle entry fills one cache line");
+
+/**
+ * A handle is a serial number above the index of its entry, so a handle
+ * reissued for the same entry differs from the one evicted
+ * */
+static std::mutex table_mutex_;
+static token_handle_entry_t *entries_ = NULL;
+static uint32_t capacity_ = 0;
+static uint32_t nb_used_ = 0;
+static int index_bits_;
+static uint32_t serial_;
+static token_handle_policy_t policy_;
+static uint32_t lru_head_;          /* most recently used */
+static uint32_t lru_tail_;          /* least recently used */
+static uint32_t clock_hand_;
+static uint64_t evictions_;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/* Replace the table; called with table_mutex_ held */
+static int
+table_init(uint32_t capacity, token_handle_policy_t policy)
+{
+    void *entries;
+
+    if(capacity < 1 || capacity > TOKEN_HANDLE_MAX_CAPACITY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(posix_memalign(&entries, TOKEN_HANDLE_CACHE_LINE,
+                      capacity * sizeof(token_handle_entry_t)) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(entries, 0, capacity * sizeof(token_handle_entry_t));
+
+    free(entries_);
+    entries_ = (token_handle_entry_t *)entries;
+    capacity_ = capacity;
+    nb_used_ = 0;
+    for(index_bits_ = 0; (1u << index_bits_) < capacity; index_bits_++) {
+    }
+    serial_ = 0;
+    policy_ = policy;
+    lru_head_ = NO_ENTRY;
+    lru_tail_ = NO_ENTRY;
+    clock_hand_ = 0;
+    evictions_ = 0;
+
+    return 0;
+}
+
+static void
+lru_unlink(uint32_t index)
+{
+    token_handle_entry_t *entry = &entries_[index];
+
+    if(entry->prev == NO_ENTRY) {
+        lru_head_ = entry->next;
+    } else {
+        entries_[entry->prev].next = entry->next;
+    }
+    if(entry->next == NO_ENTRY) {
+        lru_tail_ = entry->prev;
+    } else {
+        entries_[entry->next].prev = entry->prev;
+    }
+}
+
+static void
+lru_push_front(uint32_t index)
+{
+    token_handle_entry_t *entry = &entries_[index];
+
+    entry->prev = NO_ENTRY;
+    entry->next = lru_head_;
+    if(lru_head_ != NO_ENTRY) {
+        entries_[lru_head_].prev = index;
+    }
+    lru_head_ = index;
+    if(lru_tail_ == NO_ENTRY) {
+        lru_tail_ = index;
+    }
+}
+
+/* Mark an entry as just used */
+static void
+touch(uint32_t index)
+{
+    if(policy_ == TOKEN_HANDLE_LRU) {
+        if(lru_head_ != index) {
+            lru_unlink(index);
+            lru_push_front(index);
+        }
+    } else {
+        entries_[index].referenced = true;
+    }
+}
+
+/* Choose the entry to evict from a full table */
+static uint32_t
+choose_victim(void)
+{
+    uint32_t index;
+
+    if(policy_ == TOKEN_HANDLE_LRU) {
+        index = lru_tail_;
+        lru_unlink(index);
+        return index;
+    }
+
+    /* every entry referenced: the sweep clears them all and comes back to the first */
+    while(entries_[clock_hand_].referenced) {
+        entries_[clock_hand_].referenced = false;
+        clock_hand_ = (clock_hand_ + 1) % capacity_;
+    }
+    index = clock_hand_;
+    clock_hand_ = (clock_hand_ + 1) % capacity_;
+
+    return index;
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
+int
+token_handle_table_init(int capacity, token_handle_policy_t policy)
+{
+    std::lock_guard<std::mutex> lock(table_mutex_);
+
+    if(capacity < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return table_init((uint32_t)capacity, policy);
+}
+
+uint32_t
+token_handle_insert(uint64_t owner, const compiled_caveats_t *caveats)
+{
+    std::lock_guard<std::mutex> lock(table_mutex_);
+    token_handle_entry_t *entry;
+    uint32_t index;
+
+    if(entries_ == NULL &&
+       table_init(TOKEN_HANDLE_DEFAULT_CAPACITY, TOKEN_HANDLE_CLOCK) == -1) {
+        return 0;
+    }
+
+    if(nb_used_ < capacity_) {
+        index = nb_used_++;
+    } else {
+        index = choose_victim();
+        evictions_++;
+    }
+
+    /* serial numbers start again at 1 once they no longer fit above the index */
+    serial_++;
+    if(((uint64_t)serial_ << index_bits_) > UINT32_MAX) {
+        serial_ = 1;
+    }
+
+    entry = &entries_[index];
+    entry->handle = (serial_ << index_bits_) | index;
+    entry->owner = owner;
+    entry->caveats = *caveats;
+    entry->referenced = true;
+    if(policy_ == TOKEN_HANDLE_LRU) {
+        lru_push_front(index);
+    }
+
+    return entry->handle;
+}
+
+bool
+token_handle_lookup(uint32_t handle, uint64_t owner, compiled_caveats_t *caveats)
+{
+    std::lock_guard<std::mutex> lock(table_mutex_);
+    uint32_t index = handle & ((1u << index_bits_) - 1);
+    token_handle_entry_t *entry;
+
+    if(handle == 0 || index >= nb_used_) {
+        return false;
+    }
+
+    entry = &entries_[index];
+    if(entry->handle != handle || entry->owner != owner) {
+        return false;
+    }
+
+    *caveats = entry->caveats;
+    touch(index);
+
+    return true;
+}
+
+uint64_t
+token_handle_get_evictions(void)
+{
+    std::lock_guard<std::mutex> lock(table_mutex_);
+
+    return evictions_;
+}
+
+const char *
+get_token_handle_policy_name(token_handle_policy_t policy)
+{
+    switch(policy) {
+        case TOKEN_HANDLE_LRU:
+            return "LRU";
+        case TOKEN_HANDLE_CLOCK:
+            return "CLOCK";
+        default:
+            return "UNKNOWN";
+    }
+}